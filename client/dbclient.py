@@ -32,6 +32,13 @@ def send_req(host, req, funcname):
         sock.sendto(bytes(json.dumps(req, ensure_ascii = False), 'utf-8'), (host, port))
         try:
             ans = json.loads(str(sock.recv(config['buffsize']), 'utf-8'))
+            # A long list of names may come in several datagrams, numbered by seq.
+            if ans.get('count', 1) > 1:
+                parts = {ans['seq']: ans}
+                while len(parts) < ans['count']:
+                    part = json.loads(str(sock.recv(config['buffsize']), 'utf-8'))
+                    parts[part['seq']] = part
+                ans['name'] = [name for seq in sorted(parts) for name in parts[seq]['name']]
             if not ans['success']:
                 raise RequestFailed(f'{funcname}: {ans["what"]}')
             return ans
@@ -49,7 +56,10 @@ class RequestFailed(RuntimeError):
         super().__init__(self, msg)
 
 def report_absent(sessid, host):
-    recv = send_req(host, {'command': 'report_absent', 'sessid': sessid}, 'report_absent')
+    # Ask for datagrams that fit both our buffer and the path, so that large lessons
+    # don't get truncated or fragmented.
+    mtu = min(config['buffsize'], config.get('mtu', 1400))
+    recv = send_req(host, {'command': 'report_absent', 'sessid': sessid, 'mtu': mtu}, 'report_absent')
     return recv['name']
 
 def write_record(sessid, host, name):
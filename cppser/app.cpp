@@ -1,40 +1,29 @@
 #include "app.h"
-#include <windows.h>
 #include <string_view>
 #include <fstream>
+#include <thread>
 
 namespace Spirit {
-    void hide_window() noexcept {
-        ::ShowWindow(::GetConsoleWindow(), SW_HIDE);
-    }
-
     static bool check_db(const Configuration& config) {
         try {
-            Connection conn(config["dbname"], config["passwd"]);
-            // The number of retries
-            int retry_cnt = 0;
-            start_testing:
-            try {
-                Statement(conn, "select count(type) from sqlite_master").next();
-                Statement(conn, "select count(学生名称), count(打卡时间), count(学生编号) from 上课考勤")
-                    .next();
-                Statement(conn, "select count(安排ID), count(考勤结束时间), count(ID) from 课程信息").next();
-                Statement(conn, "select count(TerminalID) from Local_Visual_Publish").next();
-            } catch (const SQLError& ex) {
-                if (retry_cnt == 100) {
-                    // Too much, just give up
-                    throw;
-                }
-                if (sqlite3_errcode(conn) == SQLITE_BUSY || sqlite3_errcode(conn) == SQLITE_LOCKED) {
-                    ::Sleep(100);
-                    ++retry_cnt;
-                    goto start_testing;
-                } else {
-                    // Not an exception we could handle
-                    throw;
+            // If GS holds the lock, the busy handler waits for it.
+            Connection conn(config["dbname"], config["passwd"], 32, busy_policy(config));
+            // The busy handler is not called for SQLITE_LOCKED, so retry that here.
+            for (int retry_cnt = 0; ; ++retry_cnt) {
+                try {
+                    Statement(conn, "select count(type) from sqlite_master").next();
+                    Statement(conn, "select count(学生名称), count(打卡时间), count(学生编号) from 上课考勤")
+                        .next();
+                    Statement(conn, "select count(安排ID), count(考勤结束时间), count(ID) from 课程信息").next();
+                    Statement(conn, "select count(TerminalID) from Local_Visual_Publish").next();
+                    return true;
+                } catch (const SQLError&) {
+                    // Give up after 100 tries, or on errors we can't handle.
+                    if (retry_cnt == 100 || sqlite3_errcode(conn) != SQLITE_LOCKED)
+                        throw;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
                 }
             }
-            return true;
         } catch (const ErrorOpeningDatabase& ex) {
             error_dialog("Error opening database", ex.what());
         } catch (const SQLError& ex) {
@@ -84,41 +73,32 @@ namespace Spirit {
             }
             return true;
         };
+        // Optional entries must be positive ints if present.
+        auto check_opt_int = [&config, &check_int](const char* entry) {
+            return !config.contains(entry) || check_int(entry);
+        };
         bool exists = check_int("gs_port") && check_int("serv_port") && check_str("url_stu_new")
             && check_str("dbname") && check_str("passwd") && check_str("intro")
             && check_int("watchdog_poll") && check_int("retry_wait")
             && check_int("keep_logs") && check_int("timeout") && check_bool("auto_watchdog")
-            && check_int("simul_limit") && check_int("local_limit");
+            && check_int("simul_limit") && check_int("local_limit")
+            && check_opt_int("busy_initial_ms") && check_opt_int("busy_max_ms")
+            && check_opt_int("busy_deadline_ms") && check_opt_int("workers")
+            && check_opt_int("max_pending") && check_opt_int("gs_timeout");
         if (!exists)
             return false;
         if (config["simul_limit"] < config["local_limit"]) {
             error_dialog("Value error", "simul_limit >= local_limit not satisfied!");
             return false;
         }
+        try {
+            log_options(config);
+        } catch (const std::exception& ex) {
+            error_dialog("Config error", ex.what());
+            return false;
+        }
         return true;
     }
-
-    void error_dialog(std::string_view caption, std::string_view text) {
-        ::MessageBox(NULL, text.data(), caption.data(), MB_ICONERROR);
-    }
-
-    void kill_lock_mouse() {
-        std::string cmd = "taskkill.exe /f /im LockMouse.exe";
-        STARTUPINFO start;
-        ::ZeroMemory(&start, sizeof(start));
-        start.cb = sizeof(STARTUPINFO);
-        PROCESS_INFORMATION proc_info;
-        ::ZeroMemory(&proc_info, sizeof(proc_info));
-        ::CreateProcessA(
-            NULL, cmd.data(), NULL, NULL, TRUE,
-            CREATE_NO_WINDOW, NULL, NULL, &start, &proc_info
-        );
-        // Wait until child process exits.
-        ::WaitForSingleObject(proc_info.hProcess, INFINITE);
-        // Close process and thread handles. 
-        ::CloseHandle(proc_info.hProcess);
-        ::CloseHandle(proc_info.hThread);
-    }
 }
 
 int main() {
@@ -131,7 +111,7 @@ int main() {
         Logfile logfile("startup.log");
         logfile << "About to kill the lock mouse" << std::endl;
         kill_lock_mouse();
-        logfile << "Called kill_lock_mouse, last error was " << ::GetLastError() << std::endl;
+        logfile << "Called kill_lock_mouse, last error was " << last_error() << std::endl;
         std::ifstream istr("man.json");
         if (!istr) {
             logfile << "Cannot open configuration file, exiting.\n";
@@ -156,9 +136,15 @@ int main() {
     // Now we can be absolutely sure that keep_logs exist and is larger than 0.
     auto logname = select_logfile("singer", config["keep_logs"]);
     std::filesystem::rename("startup.log", logname);
-    Logfile logfile(logname, std::ios::out | std::ios::app);
-    Watchdog watchdog(config);
-    Singer singer(config);
+    Logfile logfile(logname, std::ios::out | std::ios::app, log_options(config, "singer"));
+    // Start counting the uptime.
+    metrics();
+    // The only connection to the database, shared by the watchdog and the singer.
+    DBService db(config);
+    // Likewise the only socket for talking to GS.
+    GSClient gs(config);
+    Watchdog watchdog(config, db, gs);
+    Singer singer(config, db, gs);
     if (!config["auto_watchdog"])
         watchdog.pause();
     watchdog.start();
@@ -0,0 +1,38 @@
+#ifndef SPIRIT_BENCH_UTIL_H
+#define SPIRIT_BENCH_UTIL_H
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// Spirit: Timing helpers shared by the benchmarks.
+namespace Spirit::bench {
+    using BenchClock = std::chrono::steady_clock;
+
+    // Runs fn reps times and returns the times in microseconds, sorted.
+    // prepare is run before each rep without being timed.
+    template <typename Fn, typename Prepare>
+    std::vector<double> time_runs(int reps, Fn fn, Prepare prepare) {
+        std::vector<double> times;
+        for (int i = 0; i < reps; i++) {
+            prepare();
+            const auto start = BenchClock::now();
+            fn();
+            times.push_back(std::chrono::duration<double, std::micro>(BenchClock::now() - start).count());
+        }
+        std::sort(times.begin(), times.end());
+        return times;
+    }
+
+    // Returns the median of reps runs of fn in microseconds, see time_runs.
+    template <typename Fn, typename Prepare>
+    double median_us(int reps, Fn fn, Prepare prepare) {
+        const auto times = time_runs(reps, fn, prepare);
+        return times[times.size() / 2];
+    }
+
+    template <typename Fn>
+    double median_us(int reps, Fn fn) {
+        return median_us(reps, fn, []{});
+    }
+}
+#endif
@@ -0,0 +1,64 @@
+// Benchmark for write_record: how long the exclusive transaction takes with the
+// bulk UPDATE compared with the old path, which formatted and prepared one UPDATE per student.
+// Usage: bench_write [database file], the file is recreated and can be deleted afterwards.
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include "../dbman.h"
+#include "bench_util.h"
+
+namespace {
+    using namespace Spirit;
+    using namespace Spirit::bench;
+
+    // Puts n absent students into lesson "bench".
+    void populate(Connection& conn, int n) {
+        Statement(conn, "drop table if exists 上课考勤").next();
+        Statement(conn, "create table 上课考勤 (学生编号 text, 学生名称 text, 打卡时间 text, "
+            "KeChengXinXi text, 是否排除考勤 int)").next();
+        // Without an index every UPDATE is a full scan, which would hide the prepare cost.
+        Statement(conn, "create index bench_idx on 上课考勤 (KeChengXinXi, 学生编号)").next();
+        Transaction trans(conn);
+        BulkUpdate insert(conn, "insert into 上课考勤 values (?, ?, null, 'bench', 0)");
+        for (int i = 0; i < n; i++)
+            insert.run(std::to_string(i), "学生" + std::to_string(i));
+        trans.commit();
+    }
+
+    // The path write_record used to take.
+    void legacy_write_record(Connection& conn, const std::string& lesson_id,
+        const std::vector<Student>& stu, Clock& clock
+    ) {
+        using namespace std::literals;
+        Statement(conn, "begin exclusive transaction").next();
+        for (auto&& [unused, id] : stu) {
+            const std::string sql = "update 上课考勤 set 打卡时间='"s + clock()
+                + "' where KeChengXinXi='" + lesson_id + "' and 学生编号='" + id + "'";
+            Statement(conn, sql).next();
+        }
+        Statement(conn, "end transaction").next();
+    }
+
+    // Returns the median of reps runs of fn in microseconds. The records are cleared before each run.
+    template <typename Fn>
+    double measure(Connection& conn, int reps, Fn fn) {
+        return median_us(reps, fn, [&conn]{ Statement(conn, "update 上课考勤 set 打卡时间 = null").next(); });
+    }
+}
+
+int main(int argc, char** argv) {
+    const std::string dbname = argc > 1 ? argv[1] : "bench_write.db";
+    std::remove(dbname.c_str());
+    Connection conn(dbname, "");
+    std::cout << "rows\tlegacy_us\tbulk_us\tspeedup\n";
+    for (int n : { 50, 500, 5000 }) {
+        populate(conn, n);
+        const auto stu = report_absent(conn, "bench");
+        IncrementalClock clock;
+        const int reps = n >= 5000 ? 5 : 21;
+        const auto legacy = measure(conn, reps, [&]{ legacy_write_record(conn, "bench", stu, clock); });
+        const auto bulk = measure(conn, reps, [&]{ write_record(conn, "bench", stu, clock); });
+        std::cout << n << '\t' << legacy << '\t' << bulk << '\t'
+            << legacy / std::max(bulk, 1.0) << '\n';
+    }
+}
@@ -0,0 +1,72 @@
+// Benchmark for exclude_invalid: the hashed join against the pairwise name
+// comparison simul_sign used to do, for rosters of 60, 600 and 6000 students.
+// Usage: bench_roster
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include "../roster.h"
+#include "bench_util.h"
+
+namespace {
+    using namespace Spirit;
+    using namespace Spirit::bench;
+
+    // n absent students, and the server's view of them in another order,
+    // with every fifth one invalid.
+    void make_roster(int n, std::vector<Student>& absent, std::vector<StudentStatus>& upstream) {
+        std::mt19937 random(42);
+        absent.clear();
+        upstream.clear();
+        for (int i = 0; i < n; i++) {
+            // Names share a long prefix, as UTF-8 names from one class tend to.
+            const std::string name = "高一三班学生" + std::to_string(i);
+            const std::string id = std::to_string(20230000 + i);
+            absent.push_back({ name, id });
+            upstream.push_back({ name, id, i % 5 == 0 });
+        }
+        std::shuffle(upstream.begin(), upstream.end(), random);
+    }
+
+    // The loop simul_sign used to run.
+    std::vector<Student> legacy_exclude(std::vector<Student> absent,
+        const std::vector<StudentStatus>& upstream
+    ) {
+        std::vector<Student> need_card;
+        std::vector<std::string> invalid;
+        for (auto&& stu : upstream)
+            if (stu.invalid)
+                invalid.push_back(stu.name);
+        for (auto&& i : absent) {
+            bool flag = true;
+            for (auto&& j : invalid)
+                if (i.name == j) {
+                    flag = false;
+                    break;
+                }
+            if (flag)
+                need_card.push_back(std::move(i));
+        }
+        return need_card;
+    }
+}
+
+int main() {
+    std::cout << "students\tlegacy_us\thashed_us\n";
+    std::vector<Student> absent;
+    std::vector<StudentStatus> upstream;
+    for (int n : { 60, 600, 6000 }) {
+        make_roster(n, absent, upstream);
+        // Both must pick the same students.
+        const auto expected = legacy_exclude(absent, upstream);
+        const auto actual = exclude_invalid(absent, upstream);
+        if (!std::equal(expected.begin(), expected.end(), actual.begin(), actual.end(),
+            [](const Student& a, const Student& b) { return a.id == b.id; })) {
+            std::cerr << "Results differ for " << n << " students!\n";
+            return 1;
+        }
+        const int reps = n >= 6000 ? 11 : 101;
+        const auto legacy = median_us(reps, [&]{ legacy_exclude(absent, upstream); });
+        const auto hashed = median_us(reps, [&]{ exclude_invalid(absent, upstream); });
+        std::cout << n << '\t' << legacy << '\t' << hashed << '\n';
+    }
+}
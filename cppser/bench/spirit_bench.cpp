@@ -0,0 +1,153 @@
+// Microbenchmarks for the dbman layer on a generated database, with the results as JSON.
+// Usage: spirit_bench [--db file] [--passwd key] [--days n] [--lessons n] [--students n]
+//     [--absent ratio] [--reps n] [--seed n]
+// The database is recreated on every run and can be deleted afterwards.
+// Example: spirit_bench --students 600 --reps 51 > result.json
+#include <cstdio>
+#include <iostream>
+#include "../dbgen.h"
+#include "../singd.h"
+#include "bench_util.h"
+
+namespace {
+    using namespace Spirit;
+    using namespace Spirit::bench;
+    using nlohmann::json;
+
+    struct Options {
+        std::string db = "spirit_bench.db";
+        std::string passwd = "bench";
+        int reps = 21;
+        GenOptions gen;
+    };
+
+    Options parse_args(int argc, char** argv) {
+        Options opt;
+        for (int i = 1; i < argc; i++) {
+            const std::string name = argv[i];
+            if (i + 1 == argc)
+                throw std::invalid_argument("Missing value for " + name);
+            const std::string value = argv[++i];
+            if (name == "--db")
+                opt.db = value;
+            else if (name == "--passwd")
+                opt.passwd = value;
+            else if (name == "--days")
+                opt.gen.days = std::stoi(value);
+            else if (name == "--lessons")
+                opt.gen.lessons = std::stoi(value);
+            else if (name == "--students")
+                opt.gen.students = std::stoi(value);
+            else if (name == "--absent")
+                opt.gen.absent = std::stod(value);
+            else if (name == "--reps")
+                opt.reps = std::stoi(value);
+            else if (name == "--seed")
+                opt.gen.seed = std::stoul(value);
+            else
+                throw std::invalid_argument("Unknown option " + name);
+        }
+        if (opt.gen.students < 1 || opt.reps < 1)
+            throw std::invalid_argument("students and reps should be positive");
+        return opt;
+    }
+
+    // Runs fn opt.reps times after a warm-up, prepare is run before each rep without being timed.
+    template <typename Fn, typename Prepare>
+    json measure(const std::string& name, const Options& opt, Fn fn, Prepare prepare) {
+        prepare();
+        fn();
+        const auto times = time_runs(opt.reps, fn, prepare);
+        double sum = 0;
+        for (auto t : times)
+            sum += t;
+        return {
+            { "name", name },
+            { "reps", opt.reps },
+            { "min_us", times.front() },
+            { "median_us", times[times.size() / 2] },
+            { "p90_us", times[times.size() * 9 / 10] },
+            { "max_us", times.back() },
+            { "mean_us", sum / times.size() }
+        };
+    }
+
+    template <typename Fn>
+    json measure(const std::string& name, const Options& opt, Fn fn) {
+        return measure(name, opt, fn, []{});
+    }
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    try {
+        opt = parse_args(argc, argv);
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << '\n';
+        return 2;
+    }
+    std::remove(opt.db.c_str());
+    GenStats stats;
+    {
+        Connection conn(opt.db, opt.passwd);
+        stats = generate_db(conn, opt.gen);
+    }
+    json results = json::array();
+    // Opening includes deriving the key, which only happens on the first read.
+    results.push_back(measure("connection_open", opt, [&]{
+        Connection conn(opt.db, opt.passwd);
+        Statement(conn, "select count(*) from sqlite_master").next();
+    }));
+    Connection conn(opt.db, opt.passwd);
+    const auto today = get_lesson(conn);
+    if (today.empty()) {
+        std::cerr << "No lessons today, is the clock near midnight?\n";
+        return 1;
+    }
+    const auto& lesson = today[today.size() / 2];
+    results.push_back(measure("get_lesson", opt, [&]{ get_lesson(conn); }));
+    results.push_back(measure("near_exits", opt, [&]{ near_exits(conn, 3600); }));
+    results.push_back(measure("report_absent", opt, [&]{ report_absent(conn, lesson.id); }));
+    const auto absent = report_absent(conn, lesson.id);
+    std::vector<std::string> names;
+    for (auto&& stu : absent)
+        names.push_back(stu.name);
+    auto clear = [&]{
+        auto stmt = conn.prepare("update 上课考勤 set 打卡时间 = null where KeChengXinXi = ?");
+        stmt.bind(1, lesson.id);
+        stmt.next();
+    };
+    IncrementalClock clock;
+    results.push_back(measure("write_record_names", opt, [&]{
+        write_record(conn, lesson.id, names, clock);
+    }, clear));
+    results.push_back(measure("write_record_ids", opt, [&]{
+        write_record(conn, lesson.id, absent, clock);
+    }, clear));
+    // A full scan reading every column of every record.
+    results.push_back(measure("result_row_get", opt, [&]{
+        auto stmt = conn.prepare("select 学生编号, 学生名称, 打卡时间, KeChengXinXi, 是否排除考勤 from 上课考勤");
+        std::size_t bytes = 0;
+        while (auto row = stmt.next()) {
+            bytes += row->get<std::string_view>(0).size() + row->get<std::string_view>(1).size()
+                + row->get<std::string_view>(2).size() + row->get<std::string>(3).size();
+            bytes += row->get<int>(4);
+        }
+        if (bytes == 0)
+            throw std::logic_error("Nothing read");
+    }));
+    json report = {
+        { "config", {
+            { "days", opt.gen.days }, { "lessons", opt.gen.lessons }, { "students", opt.gen.students },
+            { "absent", opt.gen.absent }, { "reps", opt.reps }, { "seed", opt.gen.seed },
+            { "encrypted", !opt.passwd.empty() }
+        } },
+        { "rows", {
+            { "lessons", stats.lessons },
+            { "records", stats.records },
+            { "absent_in_lesson", absent.size() }
+        } },
+        { "results", results }
+    };
+    std::cout << report.dump(2) << '\n';
+}
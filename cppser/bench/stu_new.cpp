@@ -0,0 +1,72 @@
+// Benchmark for parse_stu_new: the SAX extractor against parsing the whole stu_new
+// response into a DOM, as simul_sign used to do, on payloads padded with face data.
+// Usage: bench_stu_new [payload size in KiB, 1024 by default]
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include "../singd.h"
+#include "bench_util.h"
+
+namespace {
+    using namespace Spirit;
+    using namespace Spirit::bench;
+
+    // Builds a response of about kib KiB for 60 students, like the one from
+    // the school server when face data is included.
+    std::string make_payload(std::size_t kib) {
+        constexpr int students = 60;
+        std::mt19937 random(42);
+        const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        const std::size_t face_size = kib * 1024 / students;
+        nlohmann::json doc;
+        doc["message"] = "操作成功";
+        doc["code"] = 200;
+        auto& list = doc["result"]["students"] = nlohmann::json::array();
+        for (int i = 0; i < students; i++) {
+            std::string face(face_size, 'A');
+            for (auto& c : face)
+                c = alphabet[random() % alphabet.size()];
+            list.push_back({
+                { "StudentID", std::to_string(20230000 + i) },
+                { "StudentName", "学生" + std::to_string(i) },
+                { "Invalid", i % 7 == 0 },
+                { "ClassName", "高一(3)班" },
+                { "FaceData", std::move(face) },
+                { "Features", { 0.12, 0.57, -1.5e-3, 42 } }
+            });
+        }
+        doc["result"]["lesson"] = { { "ID", 1234 }, { "date", "2030-03-02T07:20:00" } };
+        return doc.dump();
+    }
+
+    // The old way: a DOM, then walking it.
+    std::vector<StudentStatus> parse_dom(const std::string& body) {
+        std::vector<StudentStatus> ans;
+        const auto doc = nlohmann::json::parse(body);
+        for (auto&& stu : doc["result"]["students"])
+            ans.push_back({ stu["StudentName"], "", stu["Invalid"] });
+        return ans;
+    }
+}
+
+int main(int argc, char** argv) {
+    const std::size_t kib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1024;
+    const auto body = make_payload(kib);
+    // Make sure both agree before timing anything.
+    const auto sax = parse_stu_new(body);
+    const auto dom = parse_dom(body);
+    if (sax.size() != dom.size() || !std::equal(sax.begin(), sax.end(), dom.begin(),
+        [](const StudentStatus& a, const StudentStatus& b) {
+            return a.name == b.name && a.invalid == b.invalid;
+        })) {
+        std::cerr << "SAX and DOM results differ!\n";
+        return 1;
+    }
+    constexpr int reps = 31;
+    const auto dom_us = median_us(reps, [&]{ parse_dom(body); });
+    const auto sax_us = median_us(reps, [&]{ parse_stu_new(body); });
+    std::cout << "bytes\tdom_us\tsax_us\tspeedup\n"
+        << body.size() << '\t' << dom_us << '\t' << sax_us << '\t'
+        << dom_us / std::max(sax_us, 1.0) << '\n';
+}
@@ -0,0 +1,56 @@
+#include "dbgen.h"
+#include <random>
+#include <stdexcept>
+
+namespace Spirit {
+    namespace {
+        std::string format_time(std::time_t t) {
+            char buf[32];
+            std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", std::localtime(&t));
+            return buf;
+        }
+    }
+
+    GenStats generate_db(Connection& conn, const GenOptions& opt) {
+        if (opt.days < 1 || opt.lessons < 1 || opt.students < 0 || opt.classes < 1)
+            throw std::invalid_argument("days, lessons and classes should be positive");
+        if (opt.absent < 0 || opt.absent > 1 || opt.excluded < 0 || opt.excluded > 1)
+            throw std::invalid_argument("absent and excluded should be between 0 and 1");
+        std::mt19937 random(opt.seed);
+        std::bernoulli_distribution is_absent(opt.absent), is_excluded(opt.excluded);
+        Statement(conn, "create table 课程信息 (ID text, 考勤结束时间 text, 安排ID int)").next();
+        Statement(conn, "create table 上课考勤 (学生编号 text, 学生名称 text, 打卡时间 text, "
+            "KeChengXinXi text, 是否排除考勤 int)").next();
+        Statement(conn, "create table Local_Visual_Publish (TerminalID text)").next();
+        Transaction trans(conn);
+        BulkUpdate(conn, "insert into Local_Visual_Publish values (?)").run(opt.machine);
+        BulkUpdate lesson(conn, "insert into 课程信息 values (?, ?, ?)");
+        BulkUpdate record(conn, "insert into 上课考勤 values (?, ?, ?, ?, ?)");
+        const auto anchor = opt.anchor ? opt.anchor : std::time(nullptr);
+        GenStats stats;
+        for (int day = 0; day < opt.days; day++) {
+            for (int i = 0; i < opt.lessons; i++) {
+                // Centered on the anchor, so that some lessons are over and some are not.
+                const auto end = anchor - static_cast<std::time_t>(opt.days - 1 - day) * 86400
+                    + static_cast<std::time_t>(i - opt.lessons / 2) * opt.spacing;
+                const auto id = "L" + std::to_string(day) + "_" + std::to_string(i);
+                const auto endtime = format_time(end);
+                lesson.run(id, endtime, static_cast<int>(stats.lessons));
+                ++stats.lessons;
+                const auto first = static_cast<std::int64_t>(i % opt.classes) * opt.students;
+                for (int s = 0; s < opt.students; s++) {
+                    const auto stu = std::to_string(first + s);
+                    const int excluded = is_excluded(random);
+                    if (is_absent(random)) {
+                        record.run(stu, "学生" + stu, nullptr, id, excluded);
+                        ++stats.absent;
+                    } else
+                        record.run(stu, "学生" + stu, endtime, id, excluded);
+                    ++stats.records;
+                }
+            }
+        }
+        trans.commit();
+        return stats;
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef SPIRIT_DBGEN_H
+#define SPIRIT_DBGEN_H
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include "dbman.h"
+
+// Spirit: Synthetic attendance databases for benchmarks and load tests.
+namespace Spirit {
+    struct GenOptions {
+        // Days with lessons, the last one is the day of anchor.
+        int days = 30;
+        // Lessons on each day
+        int lessons = 10;
+        // Students on the roster of each lesson
+        int students = 60;
+        // Number of different rosters (classes), lesson i is attended by class i % classes.
+        int classes = 1;
+        // Fraction of the records without a 打卡时间
+        double absent = 0.5;
+        // Fraction of the records with 是否排除考勤 set
+        double excluded = 0.05;
+        // Seconds between the ends of two lessons on the same day
+        int spacing = 600;
+        // The lessons of the last day end around this time, 0 means now.
+        std::time_t anchor = 0;
+        unsigned seed = 42;
+        // Goes into Local_Visual_Publish
+        std::string machine = "SPIRIT-GEN";
+    };
+
+    struct GenStats {
+        std::int64_t lessons = 0, records = 0, absent = 0;
+    };
+
+    // Creates 课程信息, 上课考勤 and Local_Visual_Publish in conn with the columns
+    // check_db probes, and fills them in one transaction.
+    // The same options and seed always give the same rows for the same anchor.
+    // Throws std::invalid_argument on bad options, SQLError if a table exists.
+    GenStats generate_db(Connection& conn, const GenOptions& opt);
+}
+#endif
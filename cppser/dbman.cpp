@@ -1,30 +1,149 @@
 #include "dbman.h"
 
+#include <algorithm>
 #include <chrono>
 #include <random>
+#include <thread>
 
 namespace Spirit {
     SQLError::SQLError(sqlite3* db) : runtime_error(sqlite3_errmsg(db))
     {}
 
-    Connection::Connection(const std::string& dbname, const std::string& passwd) {
+    StatementCache::StatementCache(std::size_t capacity) : mCapacity(capacity)
+    {}
+
+    StatementCache::~StatementCache() noexcept {
+        clear();
+    }
+
+    sqlite3_stmt* StatementCache::acquire(const std::string& sql) noexcept {
+        auto iter = mIndex.find(sql);
+        if (iter == mIndex.end()) {
+            ++mMisses;
+            return nullptr;
+        }
+        ++mHits;
+        sqlite3_stmt* const stmt = iter->second->second;
+        mEntries.erase(iter->second);
+        mIndex.erase(iter);
+        return stmt;
+    }
+
+    void StatementCache::release(sqlite3_stmt* stmt) noexcept {
+        try {
+            std::string sql = sqlite3_sql(stmt);
+            if (mCapacity == 0 || mIndex.count(sql)) {
+                // Another copy of the same statement is already idle, one is enough.
+                sqlite3_finalize(stmt);
+                return;
+            }
+            if (mEntries.size() == mCapacity) {
+                sqlite3_finalize(mEntries.back().second);
+                mIndex.erase(mEntries.back().first);
+                mEntries.pop_back();
+            }
+            mEntries.emplace_front(std::move(sql), stmt);
+            mIndex.emplace(mEntries.front().first, mEntries.begin());
+        } catch (...) {
+            // Out of memory, just don't cache it.
+            sqlite3_finalize(stmt);
+        }
+    }
+
+    void StatementCache::clear() noexcept {
+        mIndex.clear();
+        for (auto&& [sql, stmt] : mEntries)
+            sqlite3_finalize(stmt);
+        mEntries.clear();
+    }
+
+    std::size_t StatementCache::hits() const noexcept {
+        return mHits;
+    }
+
+    std::size_t StatementCache::misses() const noexcept {
+        return mMisses;
+    }
+
+    std::size_t StatementCache::size() const noexcept {
+        return mEntries.size();
+    }
+
+    BusyPolicy busy_policy(const Configuration& config) {
+        BusyPolicy policy;
+        auto read = [&config](const char* entry, std::chrono::milliseconds& value) {
+            if (config.contains(entry))
+                value = std::chrono::milliseconds(config[entry].get<int>());
+        };
+        read("busy_initial_ms", policy.initial_wait);
+        read("busy_max_ms", policy.max_wait);
+        read("busy_deadline_ms", policy.deadline);
+        return policy;
+    }
+
+    BusyHandler::BusyHandler(const BusyPolicy& policy) :
+        mPolicy(policy), mRandom(std::chrono::system_clock::now().time_since_epoch().count())
+    {}
+
+    void BusyHandler::install(sqlite3* db) noexcept {
+        sqlite3_busy_handler(db, &BusyHandler::callback, this);
+    }
+
+    const BusyStats& BusyHandler::stats() const noexcept {
+        return mStats;
+    }
+
+    int BusyHandler::callback(void* arg, int count) noexcept {
+        using namespace std::chrono;
+        auto& self = *static_cast<BusyHandler*>(arg);
+        const auto now = steady_clock::now();
+        if (count == 0) {
+            self.mStart = now;
+            ++self.mStats.events;
+        }
+        // Double the wait each time, avoiding overflows on long waits.
+        microseconds wait = self.mPolicy.max_wait;
+        if (count < 20)
+            wait = std::min<microseconds>(self.mPolicy.initial_wait * (1 << count), wait);
+        // Take off a random part of up to a half, so that waiters don't wake up in lockstep.
+        wait -= microseconds(std::uniform_int_distribution<long long>(0, wait.count() / 2)(self.mRandom));
+        if (now + wait - self.mStart > self.mPolicy.deadline) {
+            ++self.mStats.timeouts;
+            return 0;
+        }
+        std::this_thread::sleep_for(wait);
+        self.mStats.waited += duration_cast<microseconds>(steady_clock::now() - now);
+        return 1;
+    }
+
+    Connection::Connection(const std::string& dbname, const std::string& passwd,
+        std::size_t cache_size, const BusyPolicy& busy
+    ) : mCache(new StatementCache(cache_size)), mBusy(new BusyHandler(busy)) {
         if (sqlite3_open(dbname.data(), &mDB))
             throw ErrorOpeningDatabase();
         sqlite3mc_config(mDB, "cipher", 5);
         sqlite3_key(mDB, passwd.data(), passwd.size());
+        mBusy->install(mDB);
     }
 
     Connection::~Connection() noexcept {
+        // sqlite3_close fails if there are statements not finalized.
+        mCache.reset();
         sqlite3_close(mDB);
         mDB = nullptr;
     }
 
-    Connection::Connection(Connection&& rhs) noexcept : mDB(rhs.mDB) {
+    Connection::Connection(Connection&& rhs) noexcept :
+        mDB(rhs.mDB), mCache(std::move(rhs.mCache)), mBusy(std::move(rhs.mBusy)), mSteps(rhs.mSteps)
+    {
         rhs.mDB = nullptr;
     }
 
     Connection& Connection::operator = (Connection&& rhs) noexcept {
         mDB = rhs.mDB;
+        mCache = std::move(rhs.mCache);
+        mBusy = std::move(rhs.mBusy);
+        mSteps = rhs.mSteps;
         rhs.mDB = nullptr;
         return *this;
     }
@@ -37,9 +156,32 @@ namespace Spirit {
         return mDB;
     }
 
-    Statement::Statement(Connection& conn, const std::string& sql) : mConn(conn) {
+    StatementCache& Connection::cache() noexcept {
+        return *mCache;
+    }
+
+    const BusyStats& Connection::busy_stats() const noexcept {
+        return mBusy->stats();
+    }
+
+    std::uint64_t Connection::steps() const noexcept {
+        return mSteps;
+    }
+
+    Statement Connection::prepare(const std::string& sql) {
+        return Statement(*this, sql, true);
+    }
+
+    Statement::Statement(Connection& conn, const std::string& sql, bool cached) :
+        mConn(conn), mCached(cached)
+    {
         if (!conn.get())
             throw ConnectionInvalid();
+        if (cached) {
+            mStatement = conn.cache().acquire(sql);
+            if (mStatement)
+                return;
+        }
         // The pointer to the "tail" in the function call
         const char* tail = nullptr;
         const int rc = sqlite3_prepare_v2(mConn, sql.data(), sql.size(), &mStatement, &tail);
@@ -49,24 +191,46 @@ namespace Spirit {
             throw PrepareError(mConn.get());
     }
 
+    Statement::Statement(Connection& conn, const std::string& sql) :
+        Statement(conn, sql, false)
+    {}
+
     Statement::~Statement() noexcept {
-        sqlite3_finalize(mStatement);
+        if (mCached && mStatement) {
+            sqlite3_reset(mStatement);
+            sqlite3_clear_bindings(mStatement);
+            mConn.cache().release(mStatement);
+        } else
+            sqlite3_finalize(mStatement);
         mStatement = nullptr;
     }
 
+    Statement::Statement(Statement&& rhs) noexcept :
+        mConn(rhs.mConn), mStatement(rhs.mStatement), mEnd(rhs.mEnd), mCached(rhs.mCached)
+    {
+        rhs.mStatement = nullptr;
+    }
+
     sqlite3_stmt* Statement::get() noexcept {
         return mStatement;
     }
 
     std::optional<ResultRow> Statement::next() {
+        if (step())
+            return ResultRow(observer_ptr<Statement>(this));
+        return std::nullopt;
+    }
+
+    bool Statement::step() {
         if (mEnd)
-            return std::nullopt;
+            return false;
+        ++mConn.mSteps;
         const int rc = sqlite3_step(mStatement);
         if (rc == SQLITE_ROW)
-            return ResultRow(observer_ptr<Statement>(this));
+            return true;
         else if (rc == SQLITE_DONE) {
             mEnd = true;
-            return std::nullopt;
+            return false;
         }
         else
             throw SQLError(mConn.get());
@@ -76,10 +240,45 @@ namespace Spirit {
         return mEnd;
     }
 
+    void Statement::reset() noexcept {
+        sqlite3_reset(mStatement);
+        mEnd = false;
+    }
+
     ResultRow::ResultRow(const observer_ptr<Statement>& stmt) :
         mCnt(sqlite3_data_count(stmt->get())), mStmt(stmt)
     {}
 
+    Transaction::Transaction(Connection& conn, Mode mode) :
+        mConn(conn), mOwner(sqlite3_get_autocommit(conn))
+    {
+        if (mOwner)
+            mConn.prepare(mode == Mode::exclusive ? "begin exclusive transaction" : "begin transaction").next();
+    }
+
+    void Transaction::commit() {
+        if (!mOwner || mDone)
+            return;
+        mDone = true;
+        try {
+            mConn.prepare("commit transaction").next();
+        } catch (const SQLError&) {
+            // Don't leave the database locked. sqlite may have rolled back already,
+            // then this fails harmlessly.
+            sqlite3_exec(mConn, "rollback", nullptr, nullptr, nullptr);
+            throw;
+        }
+    }
+
+    Transaction::~Transaction() noexcept {
+        if (mOwner && !mDone)
+            sqlite3_exec(mConn, "rollback", nullptr, nullptr, nullptr);
+    }
+
+    BulkUpdate::BulkUpdate(Connection& conn, const std::string& sql) :
+        mConn(conn), mStmt(conn.prepare(sql))
+    {}
+
     void Clock::fill(std::string& str, int n, int pos) {
         str[pos] = '0' + n / 10;
         str[pos + 1] = '0' + n % 10;
@@ -120,7 +319,7 @@ namespace Spirit {
         mDigitGen = std::bind(dist, mt);
     }
 
-    int Clock::str2time(const std::string& timestr) {
+    int Clock::str2time(std::string_view timestr) {
         if (timestr.length() != 8 || timestr[2] != ':' || timestr[5] != ':')
             throw std::logic_error("Time string format incorrect");
         auto toint = [&timestr](int pos) {
@@ -212,23 +411,42 @@ namespace Spirit {
         const std::string query = "select ID, 考勤结束时间, 安排ID from \
         课程信息 where 考勤结束时间 > datetime('now', 'localtime', 'start of day') \
         and 考勤结束时间 < datetime('now', 'localtime', 'start of day', '1 day')";
-        Statement stmt(conn, query);
+        auto stmt = conn.prepare(query);
         std::vector<LessonInfo> res;
-        while (true) {
-            auto row = stmt.next();
-            if (!row)
-                break;
-            res.emplace_back();
-            res.back().id = row->get<std::string>(0);
-            res.back().endtime = Clock::str2time(row->get<std::string>(1).substr(11, 8));
-            res.back().anpai = row->get<int>(2);
-        }
+        for (auto [id, end, anpai] : stmt.rows<std::string_view, std::string_view, int>())
+            res.push_back({ Clock::str2time(end.substr(11, 8)), std::string(id), anpai });
         return res;
     }
 
+    int data_version(Connection& conn) {
+        auto stmt = conn.prepare("pragma data_version");
+        for (auto [version] : stmt.rows<int>())
+            return version;
+        throw std::logic_error("PRAGMA data_version returned nothing!");
+    }
+
+    const std::vector<LessonInfo>& DaySchedule::lessons(Connection& conn) {
+        const int version = data_version(conn);
+        const int day = []{
+            auto t = std::time(nullptr);
+            const auto ct = std::localtime(&t);
+            return ct->tm_year * 1000 + ct->tm_yday;
+        }();
+        if (version != mVersion || day != mDay) {
+            mLessons = get_lesson(conn);
+            mVersion = version;
+            mDay = day;
+        }
+        return mLessons;
+    }
+
+    void DaySchedule::invalidate() noexcept {
+        mVersion = mDay = -1;
+    }
+
     std::string get_machine(Connection& conn) {
         const std::string query = "select distinct TerminalID from Local_Visual_Publish";
-        Statement stmt(conn, query);
+        auto stmt = conn.prepare(query);
         auto row = stmt.next();
         if (!row)
             // No suitable information found, return something impossible
@@ -237,78 +455,50 @@ namespace Spirit {
     }
 
     std::vector<Student> report_absent(Connection& conn, const std::string& lesson_id, bool exclude_invalid) {
-        using namespace std::literals;
-        const std::string sql = "select 学生编号, 学生名称 from 上课考勤 where KeChengXinXi = '"s
-            + lesson_id + "'and 打卡时间 is null" + (exclude_invalid ? " and 是否排除考勤 = 0" : "");
-        Statement stmt(conn, sql);
+        const std::string sql = exclude_invalid
+            ? "select 学生编号, 学生名称 from 上课考勤 where KeChengXinXi = ? \
+            and 打卡时间 is null and 是否排除考勤 = 0"
+            : "select 学生编号, 学生名称 from 上课考勤 where KeChengXinXi = ? and 打卡时间 is null";
+        auto stmt = conn.prepare(sql);
+        stmt.bind(1, lesson_id);
         std::vector<Student> ans;
-        while (true) {
-            auto row = stmt.next();
-            if (!row)
-                break;
-            ans.emplace_back();
-            ans.back().id = row->get<std::string>(0);
-            ans.back().name = row->get<std::string>(1);
-        }
+        for (auto [id, name] : stmt.rows<std::string_view, std::string_view>())
+            ans.push_back({ std::string(name), std::string(id) });
         return ans;
     }
 
-    void write_record(Connection& conn, const std::string& lesson_id,
-        std::vector<std::string> names, Clock& clock
+    // The common part of the two write_record overloads.
+    // key_of maps an element of keys to the value matched by sql's third parameter.
+    template <typename Keys, typename KeyOf>
+    static std::vector<int> write_batch(Connection& conn, const std::string& sql,
+        const std::string& lesson_id, const Keys& keys, KeyOf key_of, Clock& clock
     ) {
-        std::string sql;
-        using namespace std::literals;
+        std::vector<int> affected;
+        affected.reserve(keys.size());
+        // Compile before taking the lock, so the lock is only held for the steps.
+        BulkUpdate update(conn, sql);
         // Use an exclusive transaction so that GS can't see a record that was already
         // signed in by us but didn't reach the database.
-        Statement(conn, "begin exclusive transaction").next();
-        // RAII type for ending the transaction
-        struct TransRAII {
-            TransRAII(Connection& conn) : mConn(conn) {}
-
-            virtual ~TransRAII() {
-                Statement(mConn, "end transaction").next();
-            }
+        Transaction trans(conn);
+        for (auto&& key : keys)
+            affected.push_back(update.run(clock(), lesson_id, key_of(key)));
+        trans.commit();
+        return affected;
+    }
 
-            Connection& mConn;
-        } sentry(conn);
-        for (auto&& name : names) {
-            sql = "update 上课考勤 set 打卡时间='"s
-                + clock()
-                + "' where KeChengXinXi='"
-                + lesson_id
-                + "' and 学生名称='"
-                + std::move(name)
-                + "'";
-            Statement(conn, sql).next();
-        }
+    std::vector<int> write_record(Connection& conn, const std::string& lesson_id,
+        std::vector<std::string> names, Clock& clock
+    ) {
+        const std::string sql = "update 上课考勤 set 打卡时间 = ? where KeChengXinXi = ? and 学生名称 = ?";
+        return write_batch(conn, sql, lesson_id, names,
+            [](const std::string& name) -> const std::string& { return name; }, clock);
     }
 
-    // Some highly redundant code
-    void write_record(Connection& conn, const std::string& lesson_id,
+    std::vector<int> write_record(Connection& conn, const std::string& lesson_id,
         const std::vector<Student>& stu, Clock& clock
     ) {
-        std::string sql;
-        using namespace std::literals;
-        Statement(conn, "begin exclusive transaction").next();
-        // RAII type for ending the transaction
-        struct TransRAII {
-            TransRAII(Connection& conn) : mConn(conn) {}
-
-            virtual ~TransRAII() {
-                Statement(mConn, "end transaction").next();
-            }
-
-            Connection& mConn;
-        } sentry(conn);
-        for (auto&& [unused, id] : stu) {
-            sql = "update 上课考勤 set 打卡时间='"s
-                + clock()
-                + "' where KeChengXinXi='"
-                + lesson_id
-                + "' and 学生编号='"
-                + id
-                + "'";
-            Statement(conn, sql).next();
-        }
+        const std::string sql = "update 上课考勤 set 打卡时间 = ? where KeChengXinXi = ? and 学生编号 = ?";
+        return write_batch(conn, sql, lesson_id, stu,
+            [](const Student& s) -> const std::string& { return s.id; }, clock);
     }
 }
\ No newline at end of file
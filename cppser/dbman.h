@@ -2,8 +2,17 @@
 #define SPIRIT_DBMAN_H
 #include <sqlite3mc.h>
 
+#include <chrono>
+#include <cstdint>
 #include <experimental/memory>
+#include <iterator>
+#include <list>
+#include <memory>
 #include <optional>
+#include <random>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 #include <type_traits>
 #include <nlohmann/json.hpp>
@@ -23,17 +32,117 @@ namespace Spirit {
         SQLError(sqlite3* db);
     };
 
+    // Forward decl
+    class Statement;
+
     struct ErrorOpeningDatabase : public SQLError {
         ErrorOpeningDatabase() : SQLError("Error opening database!") {}
     };
 
+    // LRU cache of prepared statements, keyed by their SQL text.
+    // Only idle statements live in here. A Statement handed out by Connection::prepare()
+    // is taken out of the cache and put back (reset and cleared) when it is destroyed.
+    class StatementCache {
+    public:
+        explicit StatementCache(std::size_t capacity);
+
+        // Finalizes all the idle statements.
+        virtual ~StatementCache() noexcept;
+
+        // The cache owns raw handles, no copy.
+        StatementCache(const StatementCache&) = delete;
+        StatementCache& operator = (const StatementCache&) = delete;
+
+        // Takes the idle statement compiled from sql out of the cache.
+        // Returns nullptr on a miss, in which case the caller should prepare one itself.
+        sqlite3_stmt* acquire(const std::string& sql) noexcept;
+
+        // Gives an idle statement back to the cache. stmt must have been reset.
+        // If the cache is full, the least recently used statement is finalized.
+        void release(sqlite3_stmt* stmt) noexcept;
+
+        // Finalizes all the idle statements.
+        void clear() noexcept;
+
+        // Number of acquire() calls that found / didn't find a statement.
+        std::size_t hits() const noexcept;
+        std::size_t misses() const noexcept;
+
+        // Number of idle statements in the cache.
+        std::size_t size() const noexcept;
+    private:
+        using Entry = std::pair<std::string, sqlite3_stmt*>;
+        std::size_t mCapacity;
+        std::size_t mHits = 0, mMisses = 0;
+        // Most recently used entries come first.
+        std::list<Entry> mEntries;
+        // The keys point into the strings stored in mEntries.
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> mIndex;
+    };
+
+    // How a Connection waits when the database is locked by someone else, usually GS.
+    // The waits start at initial_wait and double up to max_wait, each shortened by a
+    // random jitter of up to a half. Once deadline has passed, SQLITE_BUSY is reported.
+    struct BusyPolicy {
+        std::chrono::milliseconds initial_wait{ 2 };
+        std::chrono::milliseconds max_wait{ 100 };
+        std::chrono::milliseconds deadline{ 10000 };
+    };
+
+    // Reads the optional busy_initial_ms, busy_max_ms and busy_deadline_ms entries of config.
+    // Entries which are not present keep their defaults.
+    BusyPolicy busy_policy(const Configuration& config);
+
+    // What the busy handler of a Connection has been through.
+    struct BusyStats {
+        // Number of statements that found the database locked
+        std::size_t events = 0;
+        // Number of those that gave up after the deadline
+        std::size_t timeouts = 0;
+        // Total time spent waiting
+        std::chrono::microseconds waited{ 0 };
+    };
+
+    // The state of the busy handler installed on a Connection.
+    class BusyHandler {
+    public:
+        explicit BusyHandler(const BusyPolicy& policy);
+
+        // Installs this as db's busy handler.
+        void install(sqlite3* db) noexcept;
+
+        const BusyStats& stats() const noexcept;
+    private:
+        BusyPolicy mPolicy;
+        BusyStats mStats;
+        std::mt19937 mRandom;
+        // When sqlite first asked us to wait for the current statement
+        std::chrono::steady_clock::time_point mStart;
+
+        // The callback given to sqlite3_busy_handler, arg is the BusyHandler.
+        // count is the number of times it has been called for the same statement.
+        // Returns 0 to give up, non-zero to try again.
+        static int callback(void* arg, int count) noexcept;
+    };
+
     // Simple wrapper for a database
     class Connection {
     private:
         sqlite3* mDB = nullptr;
+        // On the heap so that moving the connection doesn't move the cache.
+        std::unique_ptr<StatementCache> mCache;
+        // On the heap because sqlite keeps a pointer to it.
+        std::unique_ptr<BusyHandler> mBusy;
+        // Number of sqlite3_step() calls made by Statements on this connection.
+        std::uint64_t mSteps = 0;
+
+        friend class Statement;
     public:
         // Opens a database
-        explicit Connection(const std::string& dbname, const std::string& passwd);
+        // cache_size is the number of idle prepared statements kept around.
+        // busy decides how long we wait for locks held by others.
+        explicit Connection(const std::string& dbname, const std::string& passwd,
+            std::size_t cache_size = 32, const BusyPolicy& busy = BusyPolicy());
 
         virtual ~Connection() noexcept;
 
@@ -49,6 +158,19 @@ namespace Spirit {
         sqlite3* get() noexcept;
 
         operator sqlite3* () noexcept;
+
+        // The cache of prepared statements, also useful for reading the counters.
+        StatementCache& cache() noexcept;
+
+        // The counters of the busy handler.
+        const BusyStats& busy_stats() const noexcept;
+
+        // Number of times a Statement has been stepped.
+        std::uint64_t steps() const noexcept;
+
+        // Returns a statement for sql, reusing a cached one if possible.
+        // Use this for SQL that is run over and over again.
+        Statement prepare(const std::string& sql);
     };
 
     struct ConnectionInvalid : public SQLError {
@@ -70,8 +192,20 @@ namespace Spirit {
         {}
     };
 
-    // Forward decl
-    class Statement;
+    struct BindError : public SQLError {
+        using SQLError::SQLError;
+    };
+
+    struct ColumnCountError : public SQLError {
+        ColumnCountError() : SQLError("The statement doesn't have the requested number of columns.")
+        {}
+    };
+
+    // Non-owning view of some binary data, used for blobs.
+    struct BlobView {
+        const unsigned char* data = nullptr;
+        std::size_t size = 0;
+    };
 
     // A row in the SQL result
     class ResultRow {
@@ -82,52 +216,289 @@ namespace Spirit {
         // Defined later
         ResultRow(const observer_ptr<Statement>& mStmt);
 
+        // Reads column col as T, which is one of int, std::int64_t, double,
+        // std::string, std::string_view, BlobView, or an std::optional of them.
+        // NULL reads as 0 or empty, or std::nullopt if T is an optional.
+        // std::string_view and BlobView borrow sqlite's buffer, which is only valid
+        // until the next step or reset of the statement.
         template <typename T>
         T get(int col);
     };
 
+    // Forward decl
+    template <typename... Ts>
+    class RowRange;
+
     // This class represents a query
     class Statement {
     private:
         Connection& mConn;
         sqlite3_stmt* mStatement = nullptr;
         bool mEnd = false;
+        // True if the handle should be given back to mConn's cache
+        bool mCached = false;
+
+        // Used by Connection::prepare()
+        Statement(Connection& conn, const std::string& sql, bool cached);
+
+        friend class Connection;
     public:
         // Constructor calls sqlite3_prepare_v2
         // Expects that conn is a valid connection, 
         Statement(Connection& conn, const std::string& sql);
 
-        // Destructor calls sqlite3_finalize
+        // Destructor calls sqlite3_finalize, or returns the statement to the cache.
         virtual ~Statement() noexcept;
 
         // Disable copying
         Statement(const Statement&) = delete;
         Statement& operator= (const Statement&) = delete;
 
-        // Move constructor is OK
-        Statement(Statement&& rhs) noexcept = default;
-        Statement& operator = (Statement&& rhs) noexcept = default;
+        // Move constructor is OK, the moved-from Statement no longer owns the handle.
+        // Assignment is impossible because of the reference.
+        Statement(Statement&& rhs) noexcept;
+        Statement& operator = (Statement&& rhs) = delete;
 
         sqlite3_stmt* get() noexcept;
 
         std::optional<ResultRow> next();
 
+        // Steps the statement without building a row.
+        // Returns true if a row is available, false if the statement is done.
+        bool step();
+
         bool is_end() noexcept;
+
+        // Returns an input range over the remaining rows, each read as std::tuple<Ts...>:
+        //     for (auto [id, name] : stmt.rows<std::string_view, std::string_view>())
+        // The types are checked at compile time, the column count once here,
+        // so reading a row costs no checks at all.
+        // Throws ColumnCountError if the statement doesn't have sizeof...(Ts) columns.
+        template <typename... Ts>
+        RowRange<Ts...> rows();
+
+        // Binds value to the parameter at index. Index starts from 1, as in sqlite3_bind_*.
+        // Supports int, std::int64_t, double, text (std::string, std::string_view, const char*),
+        // BlobView and nullptr (NULL). Text and blobs are copied by sqlite, so temporaries are OK.
+        // Throws BindError if sqlite refuses the value.
+        template <typename T>
+        void bind(int index, T&& value);
+
+        // Binds the arguments to parameters 1, 2, 3...
+        template <typename... Args>
+        void bind_all(Args&&... args);
+
+        // Makes the statement ready to be stepped again. Bindings are kept.
+        void reset() noexcept;
     };
 
+    template <typename T>
+    void Statement::bind(int index, T&& value) {
+        using U = std::decay_t<T>;
+        int rc = SQLITE_OK;
+        if constexpr (std::is_same_v<U, int>)
+            rc = sqlite3_bind_int(mStatement, index, value);
+        else if constexpr (std::is_same_v<U, std::int64_t> || std::is_same_v<U, long long>)
+            rc = sqlite3_bind_int64(mStatement, index, value);
+        else if constexpr (std::is_same_v<U, double>)
+            rc = sqlite3_bind_double(mStatement, index, value);
+        else if constexpr (std::is_same_v<U, std::string> || std::is_same_v<U, std::string_view>)
+            rc = sqlite3_bind_text(mStatement, index, value.data(), value.size(), SQLITE_TRANSIENT);
+        else if constexpr (std::is_same_v<U, const char*> || std::is_same_v<U, char*>)
+            rc = sqlite3_bind_text(mStatement, index, value, -1, SQLITE_TRANSIENT);
+        else if constexpr (std::is_same_v<U, BlobView>)
+            rc = sqlite3_bind_blob64(mStatement, index, value.data, value.size, SQLITE_TRANSIENT);
+        else if constexpr (std::is_same_v<U, std::nullptr_t>)
+            rc = sqlite3_bind_null(mStatement, index);
+        else
+            static_assert(!sizeof(U), "Type is not supported!");
+        if (rc != SQLITE_OK)
+            throw BindError(mConn.get());
+    }
+
+    template <typename... Args>
+    void Statement::bind_all(Args&&... args) {
+        int index = 0;
+        (bind(++index, std::forward<Args>(args)), ...);
+    }
+
+    namespace detail {
+        template <typename T>
+        struct is_optional : std::false_type {};
+
+        template <typename T>
+        struct is_optional<std::optional<T>> : std::true_type {};
+
+        // True if column<T>() can read a T.
+        template <typename T>
+        constexpr bool is_column_type = std::is_same_v<T, int> || std::is_same_v<T, std::int64_t>
+            || std::is_same_v<T, double> || std::is_same_v<T, std::string>
+            || std::is_same_v<T, std::string_view> || std::is_same_v<T, BlobView>;
+
+        template <typename T>
+        constexpr bool is_column_type<std::optional<T>> = is_column_type<T>;
+
+        // Reads column col of the current row in stmt, without any checks.
+        // NULL reads as 0 or empty, unless T is an optional.
+        template <typename T>
+        T column(sqlite3_stmt* stmt, int col) {
+            static_assert(is_column_type<T>, "Type is not supported!");
+            if constexpr (is_optional<T>::value) {
+                if (sqlite3_column_type(stmt, col) == SQLITE_NULL)
+                    return std::nullopt;
+                return column<typename T::value_type>(stmt, col);
+            } else if constexpr (std::is_same_v<T, int>)
+                return sqlite3_column_int(stmt, col);
+            else if constexpr (std::is_same_v<T, std::int64_t>)
+                return sqlite3_column_int64(stmt, col);
+            else if constexpr (std::is_same_v<T, double>)
+                return sqlite3_column_double(stmt, col);
+            else if constexpr (std::is_same_v<T, BlobView>) {
+                // Call order as recommended by the sqlite docs.
+                const void* data = sqlite3_column_blob(stmt, col);
+                return { static_cast<const unsigned char*>(data),
+                    static_cast<std::size_t>(sqlite3_column_bytes(stmt, col)) };
+            } else {
+                const auto data = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+                if (!data)
+                    return T();
+                return T(data, sqlite3_column_bytes(stmt, col));
+            }
+        }
+    }
+
     template <typename T>
     T ResultRow::get(int col) {
         // Index starts from 0
-        static_assert(std::is_same_v<T, int> || std::is_same_v<T, std::string>,
-            "Type is not supported!");
         if (col < 0 || col >= mCnt)
             throw std::out_of_range("col is out of range!");
-        if constexpr (std::is_same_v<T, int>)
-            return sqlite3_column_int(mStmt->get(), col);
-        else if constexpr (std::is_same_v<T, std::string>)
-            return reinterpret_cast<const char*>(sqlite3_column_text(mStmt->get(), col));
-        else
-            throw std::logic_error("Type not supported!");
+        return detail::column<T>(mStmt->get(), col);
+    }
+
+    // The range returned by Statement::rows(). Only good for one pass.
+    template <typename... Ts>
+    class RowRange {
+    public:
+        class iterator {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = std::tuple<Ts...>;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = value_type;
+
+            // The end iterator
+            iterator() = default;
+
+            // Steps to the first row
+            explicit iterator(Statement* stmt) : mStmt(stmt) {
+                advance();
+            }
+
+            value_type operator * () const {
+                return read(std::index_sequence_for<Ts...>());
+            }
+
+            iterator& operator ++ () {
+                advance();
+                return *this;
+            }
+
+            bool operator == (const iterator& rhs) const noexcept {
+                return mStmt == rhs.mStmt;
+            }
+
+            bool operator != (const iterator& rhs) const noexcept {
+                return mStmt != rhs.mStmt;
+            }
+        private:
+            // nullptr once the statement is done
+            Statement* mStmt = nullptr;
+
+            void advance() {
+                if (!mStmt->step())
+                    mStmt = nullptr;
+            }
+
+            template <std::size_t... Is>
+            value_type read(std::index_sequence<Is...>) const {
+                return value_type(detail::column<Ts>(mStmt->get(), Is)...);
+            }
+        };
+
+        explicit RowRange(Statement& stmt) : mStmt(&stmt)
+        {}
+
+        iterator begin() {
+            return iterator(mStmt);
+        }
+
+        iterator end() noexcept {
+            return iterator();
+        }
+    private:
+        Statement* mStmt;
+    };
+
+    template <typename... Ts>
+    RowRange<Ts...> Statement::rows() {
+        static_assert((detail::is_column_type<Ts> && ...), "Type is not supported!");
+        if (sqlite3_column_count(mStatement) != sizeof...(Ts))
+            throw ColumnCountError();
+        return RowRange<Ts...>(*this);
+    }
+
+    // RAII type for an exclusive transaction. It is only committed by commit(),
+    // if it is destroyed before that (on an exception, say), it is rolled back.
+    // Use this so that GS can't see a half-written batch.
+    // Inside another transaction it does nothing, the outer one decides how to end.
+    class Transaction {
+    public:
+        // A deferred transaction takes its read snapshot at the first read
+        // and only locks the database for writing when it first writes.
+        enum class Mode { deferred, exclusive };
+
+        // Begins the transaction, throws SQLError on failure.
+        explicit Transaction(Connection& conn, Mode mode = Mode::exclusive);
+
+        // Commits the transaction. If that fails, rolls back and throws SQLError,
+        // so nothing of it was saved.
+        void commit();
+
+        // Rolls back the transaction if it wasn't committed.
+        virtual ~Transaction() noexcept;
+
+        Transaction(const Transaction&) = delete;
+        Transaction& operator = (const Transaction&) = delete;
+    private:
+        Connection& mConn;
+        // False if an enclosing transaction was already open.
+        bool mOwner;
+        bool mDone = false;
+    };
+
+    // Runs one UPDATE (or any statement without results) for a batch of parameter sets.
+    // The statement is compiled once; every run() is just bind, step and reset.
+    class BulkUpdate {
+    public:
+        BulkUpdate(Connection& conn, const std::string& sql);
+
+        // Binds args to the parameters 1, 2, 3..., steps the statement
+        // and returns the number of rows it changed.
+        template <typename... Args>
+        int run(Args&&... args);
+    private:
+        Connection& mConn;
+        Statement mStmt;
+    };
+
+    template <typename... Args>
+    int BulkUpdate::run(Args&&... args) {
+        mStmt.bind_all(std::forward<Args>(args)...);
+        mStmt.next();
+        const int changes = sqlite3_changes(mConn);
+        mStmt.reset();
+        return changes;
     }
 
     // Base class for a clock (to get the time string for the db)
@@ -160,7 +531,7 @@ namespace Spirit {
 
         // Given a string of 'xx:xx:xx', returns the second it is in a day
         // For example, '07:00:00' -> 3600 * 7
-        static int str2time(const std::string& timestr);
+        static int str2time(std::string_view timestr);
 
         // Reverse of above.
         // Format: 07:20:00
@@ -223,6 +594,29 @@ namespace Spirit {
     // Expects that the database now contains the required info
     std::vector<LessonInfo> get_lesson(Connection& conn);
 
+    // Returns PRAGMA data_version, which changes whenever another connection
+    // commits to the database.
+    int data_version(Connection& conn);
+
+    // Today's lessons kept in memory. 课程信息 is only queried again when
+    // another connection has changed the database or the date has changed,
+    // so in the steady state a lookup costs one PRAGMA.
+    // Always use the same connection, data_version is per connection.
+    class DaySchedule {
+    public:
+        // Returns today's lessons as get_lesson() does. The reference is valid
+        // until the next call.
+        const std::vector<LessonInfo>& lessons(Connection& conn);
+
+        // Forgets the cached lessons, the next lessons() will query again.
+        void invalidate() noexcept;
+    private:
+        std::vector<LessonInfo> mLessons;
+        // data_version and the day when mLessons was loaded, -1 if not loaded.
+        int mVersion = -1;
+        int mDay = -1;
+    };
+
     // Returns the machine's ID
     std::string get_machine(Connection& conn);
 
@@ -239,13 +633,13 @@ namespace Spirit {
 
     // Writes records to the database using the given clock for the given names
     // for the given lesson. (Whew)
-    // If access to the database is interrupted, will retry.
-    // This is a little slow, so you can use async() to launch it.
-    void write_record(Connection& conn, const std::string& lesson_id,
+    // All the records are written in one exclusive transaction with a single UPDATE.
+    // Returns the number of rows affected for each name, in order.
+    std::vector<int> write_record(Connection& conn, const std::string& lesson_id,
         std::vector<std::string> names, Clock& clock);
 
-    // Actually the same as above, just a convenience function.
-    void write_record(Connection& conn, const std::string& lesson_id,
+    // Same as above, but the students are matched by their IDs.
+    std::vector<int> write_record(Connection& conn, const std::string& lesson_id,
         const std::vector<Student>& stu, Clock& clock);
 }
 
@@ -0,0 +1,48 @@
+#include "dbservice.h"
+
+namespace Spirit {
+    DBService::DBService(const Configuration& config) :
+        mConn(config["dbname"], config["passwd"], 32, busy_policy(config))
+    {
+        mThread = std::thread([this]{ worker(); });
+    }
+
+    DBService::~DBService() noexcept {
+        {
+            std::lock_guard lock(mMutex);
+            mStop = true;
+        }
+        mCond.notify_one();
+        if (mThread.joinable())
+            mThread.join();
+    }
+
+    void DBService::push(Task task, Priority prio) {
+        {
+            std::lock_guard lock(mMutex);
+            if (prio == Priority::high)
+                mHigh.push_back(std::move(task));
+            else
+                mNormal.push_back(std::move(task));
+        }
+        mCond.notify_one();
+    }
+
+    void DBService::worker() {
+        while (true) {
+            Task task;
+            {
+                std::unique_lock lock(mMutex);
+                mCond.wait(lock, [this]{ return mStop || !mHigh.empty() || !mNormal.empty(); });
+                auto& queue = mHigh.empty() ? mNormal : mHigh;
+                if (queue.empty())
+                    // Stopped and nothing left
+                    return;
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            // Exceptions are caught by the packaged_task.
+            task(mConn);
+        }
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef SPIRIT_DBSERVICE_H
+#define SPIRIT_DBSERVICE_H
+#include <any>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "dbman.h"
+
+namespace Spirit {
+    // Owns the only connection to the local database and runs jobs on it in its own thread.
+    // Singer and Watchdog submit jobs here instead of opening connections of their own,
+    // so they no longer fight each other for locks.
+    class DBService {
+    public:
+        enum class Priority { normal, high };
+
+        // Opens the database named in the config, so that errors surface in the caller,
+        // then starts the thread. Throws ErrorOpeningDatabase.
+        explicit DBService(const Configuration& config);
+
+        // Runs the jobs already queued, then stops the thread.
+        virtual ~DBService() noexcept;
+
+        // The thread refers to this.
+        DBService(const DBService&) = delete;
+        DBService& operator = (const DBService&) = delete;
+        DBService(DBService&&) = delete;
+        DBService& operator = (DBService&&) = delete;
+
+        // Queues job, which will be called as job(Connection&) in the service thread.
+        // High priority jobs run before all normal ones. Exceptions thrown by job
+        // are passed through the future.
+        template <typename Job>
+        auto submit(Job&& job, Priority prio = Priority::normal)
+            -> std::future<std::invoke_result_t<Job&, Connection&>>;
+
+        // Like submit(), but if a job with the same key is still queued, its result is
+        // shared instead of queuing another one. So jobs with the same key should read
+        // the same thing, and must return the same type.
+        template <typename Job>
+        auto submit_read(const std::string& key, Job&& job)
+            -> std::shared_future<std::invoke_result_t<Job&, Connection&>>;
+    private:
+        using Task = std::function<void(Connection&)>;
+
+        // Used by mThread only, after the constructor returns.
+        Connection mConn;
+        // Protects everything below except mThread.
+        std::mutex mMutex;
+        std::condition_variable mCond;
+        std::deque<Task> mHigh, mNormal;
+        // The shared futures of queued read jobs, by key.
+        std::unordered_map<std::string, std::any> mReads;
+        bool mStop = false;
+        std::thread mThread;
+
+        void push(Task task, Priority prio);
+
+        void worker();
+    };
+
+    template <typename Job>
+    auto DBService::submit(Job&& job, Priority prio)
+        -> std::future<std::invoke_result_t<Job&, Connection&>>
+    {
+        using Result = std::invoke_result_t<Job&, Connection&>;
+        // std::function needs a copyable callable
+        auto task = std::make_shared<std::packaged_task<Result(Connection&)>>(std::forward<Job>(job));
+        auto fut = task->get_future();
+        push([task](Connection& conn) { (*task)(conn); }, prio);
+        return fut;
+    }
+
+    template <typename Job>
+    auto DBService::submit_read(const std::string& key, Job&& job)
+        -> std::shared_future<std::invoke_result_t<Job&, Connection&>>
+    {
+        using Result = std::invoke_result_t<Job&, Connection&>;
+        std::lock_guard lock(mMutex);
+        auto iter = mReads.find(key);
+        if (iter != mReads.end())
+            return std::any_cast<std::shared_future<Result>>(iter->second);
+        auto task = std::make_shared<std::packaged_task<Result(Connection&)>>(std::forward<Job>(job));
+        std::shared_future<Result> fut = task->get_future().share();
+        mReads.emplace(key, fut);
+        mNormal.push_back([this, key, task](Connection& conn) {
+            {
+                // From now on the result might be stale, so later jobs are queued again.
+                std::lock_guard lock(mMutex);
+                mReads.erase(key);
+            }
+            (*task)(conn);
+        });
+        mCond.notify_one();
+        return fut;
+    }
+}
+
+#endif
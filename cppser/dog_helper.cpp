@@ -1,31 +1,73 @@
 #include "singd.h"
-#include <array>
 #include <algorithm>
-#include <boost/asio.hpp>
 #include <iterator>
-#include <memory>
 #include <regex>
 
 namespace Spirit {
+    const LessonInfo* next_lesson(const std::vector<LessonInfo>& timeline, int now, int last_proc) noexcept {
+        // Lessons ending at or before last_proc are done, even if they haven't ended yet.
+        const int after = std::max(now, last_proc);
+        const auto next = std::find_if(timeline.begin(), timeline.end(),
+            [after](const LessonInfo& lesson) { return lesson.endtime > after; });
+        return next == timeline.end() ? nullptr : &*next;
+    }
+
     std::vector<LessonInfo> near_exits(Connection& conn, int sec) {
         std::vector<LessonInfo> ans;
         const std::string sql = "select 考勤结束时间, ID, 安排ID from 课程信息 where "
             "考勤结束时间 > datetime('now', 'localtime') and "
-            "考勤结束时间 < datetime('now', 'localtime', '" + std::to_string(sec) + " seconds')";
-        Statement stmt(conn, sql);
-        while (true) {
-            auto row = stmt.next();
-            if (!row)
-                break;
-            ans.push_back({
-                Clock::str2time(row->get<std::string>(0).substr(11)),
-                row->get<std::string>(1),
-                row->get<int>(2)
-            });
-        }
+            "考勤结束时间 < datetime('now', 'localtime', ?)";
+        auto stmt = conn.prepare(sql);
+        stmt.bind(1, std::to_string(sec) + " seconds");
+        for (auto [end, id, anpai] : stmt.rows<std::string_view, std::string_view, int>())
+            ans.push_back({ Clock::str2time(end.substr(11)), std::string(id), anpai });
         return ans;
     }
 
+    LogOptions log_options(const Configuration& config, const std::string& base) {
+        LogOptions options;
+        if (config.contains("log_level")) {
+            const std::string level = config["log_level"];
+            if (level == "debug")
+                options.level = LogLevel::debug;
+            else if (level == "info")
+                options.level = LogLevel::info;
+            else if (level == "warn")
+                options.level = LogLevel::warn;
+            else if (level == "error")
+                options.level = LogLevel::error;
+            else
+                throw std::invalid_argument("Unknown log_level: " + level);
+        }
+        if (config.contains("log_format")) {
+            const std::string format = config["log_format"];
+            if (format != "text" && format != "json")
+                throw std::invalid_argument("Unknown log_format: " + format);
+            options.json = format == "json";
+        }
+        if (config.contains("log_limits")) {
+            for (auto&& [category, entry] : config["log_limits"].items()) {
+                LogLimit limit;
+                limit.sample = std::max(entry.value("sample", 1u), 1u);
+                limit.max_bytes = entry.value("max_bytes", std::size_t(0));
+                options.limits.emplace(category, limit);
+            }
+        }
+        auto& rotation = options.rotation;
+        rotation.max_bytes = config.value("log_rotate_mb", std::uint64_t(16)) * 1024 * 1024;
+        rotation.max_age = std::chrono::hours(config.value("log_rotate_hours", 0));
+        rotation.compress = config.value("log_compress", false);
+#ifndef SPIRIT_LOG_GZIP
+        if (rotation.compress)
+            throw std::invalid_argument("log_compress needs a build with SPIRIT_LOG_GZIP");
+#endif
+        if (!base.empty()) {
+            rotation.base = base;
+            rotation.keep = config["keep_logs"];
+        }
+        return options;
+    }
+
     void parse_url(const Configuration& config, std::string& host, std::string& url) {
         // First, we will get the URL.
         url = config["url_stu_new"];
@@ -37,16 +79,143 @@ namespace Spirit {
         host = matched[0];
     }
 
-    nlohmann::json execute_request(
+    namespace {
+        // SAX handler for parse_stu_new(). It keeps a stack of where it is,
+        // only looking at the values on the path result.students[*].
+        class StuNewHandler : public nlohmann::json_sax<nlohmann::json> {
+        public:
+            explicit StuNewHandler(std::vector<StudentStatus>& out) : mOut(out)
+            {}
+
+            bool null() override {
+                return true;
+            }
+
+            bool boolean(bool val) override {
+                if (mField == Field::invalid)
+                    mCurrent.invalid = val;
+                return true;
+            }
+
+            bool number_integer(number_integer_t val) override {
+                if (mField == Field::invalid)
+                    mCurrent.invalid = val != 0;
+                return true;
+            }
+
+            bool number_unsigned(number_unsigned_t val) override {
+                if (mField == Field::invalid)
+                    mCurrent.invalid = val != 0;
+                return true;
+            }
+
+            bool number_float(number_float_t, const string_t&) override {
+                return true;
+            }
+
+            bool string(string_t& val) override {
+                if (mField == Field::name)
+                    mCurrent.name = std::move(val);
+                else if (mField == Field::id)
+                    mCurrent.id = std::move(val);
+                return true;
+            }
+
+            bool binary(binary_t&) override {
+                return true;
+            }
+
+            bool start_object(std::size_t) override {
+                const Where parent = mPath.empty() ? Where::outside : mPath.back();
+                if (parent == Where::outside)
+                    mPath.push_back(Where::root);
+                else if (parent == Where::root && mKey == "result")
+                    mPath.push_back(Where::result);
+                else if (parent == Where::students) {
+                    mPath.push_back(Where::student);
+                    mCurrent = StudentStatus();
+                } else
+                    mPath.push_back(Where::other);
+                mField = Field::none;
+                return true;
+            }
+
+            bool end_object() override {
+                if (mPath.back() == Where::student)
+                    mOut.push_back(std::move(mCurrent));
+                mPath.pop_back();
+                mField = Field::none;
+                return true;
+            }
+
+            bool start_array(std::size_t) override {
+                const bool students = !mPath.empty() && mPath.back() == Where::result && mKey == "students";
+                mPath.push_back(students ? Where::students : Where::other);
+                mField = Field::none;
+                return true;
+            }
+
+            bool end_array() override {
+                mPath.pop_back();
+                return true;
+            }
+
+            bool key(string_t& val) override {
+                mField = Field::none;
+                switch (mPath.back()) {
+                case Where::root:
+                case Where::result:
+                    mKey = std::move(val);
+                    break;
+                case Where::student:
+                    if (val == "StudentName")
+                        mField = Field::name;
+                    else if (val == "StudentID")
+                        mField = Field::id;
+                    else if (val == "Invalid")
+                        mField = Field::invalid;
+                    break;
+                default:
+                    // Not on our path, don't bother copying the key.
+                    break;
+                }
+                return true;
+            }
+
+            bool parse_error(std::size_t, const std::string&, const nlohmann::json::exception& ex) override {
+                if (auto err = dynamic_cast<const nlohmann::json::parse_error*>(&ex))
+                    throw *err;
+                // Like a number out of range, the response isn't what we expected.
+                throw NetworkError("Bad stu_new response: "s + ex.what());
+            }
+        private:
+            enum class Where { outside, root, result, students, student, other };
+            enum class Field { none, name, id, invalid };
+            std::vector<StudentStatus>& mOut;
+            std::vector<Where> mPath;
+            // The last key seen in the root or result object
+            std::string mKey;
+            // The student being read, and which of its fields the next value is
+            StudentStatus mCurrent;
+            Field mField = Field::none;
+        };
+    }
+
+    std::vector<StudentStatus> parse_stu_new(std::string_view body) {
+        std::vector<StudentStatus> ans;
+        StuNewHandler handler(ans);
+        nlohmann::json::sax_parse(body.begin(), body.end(), &handler);
+        return ans;
+    }
+
+    std::vector<StudentStatus> get_stu_new(
+        HttpClient& client,
         const Configuration& config,
         const std::vector<Student>& absent,
         const LessonInfo& lesson,
         Logfile& logfile
     ) {
-        namespace asio = boost::asio;
         std::string url, host;
-        const auto thread_id = std::this_thread::get_id();
-        logfile << thread_id << " set out to execute request.\n";
         parse_url(config, host, url);
         // The request body
         const std::string req_body = [&]{
@@ -57,137 +226,9 @@ namespace Spirit {
             j["faceversion"] = 2;
             return j.dump();
         }();
-        // See example, sync HTTP client
-        asio::io_context ioc;
-        asio::ip::tcp::resolver resolver(ioc);
-        asio::ip::tcp::socket socket(ioc);
-        // RAII object to ensure log is flushed when error occurs.
-        LogSection log_section(logfile);
-        // Write the request.
-        asio::streambuf req;
-        std::ostream req_stream(&req);
-        req_stream << "POST " << url << " HTTP/1.1\r\n"
-            << "Content-Type: application/json\r\n"
-            << "Host: " << host << "\r\n"
-            << "Content-Length: " << req_body.size() << "\r\n"
-            << "Connection: close\r\n\r\n"
-            << req_body;
-        try {
-            asio::connect(socket, resolver.resolve(host, "http"));
-        } catch (const boost::system::system_error& ex) {
-            throw NetworkError(ex.what());
-        }
-        logfile << thread_id << " connected to the school server.\n";
-        try {
-            asio::write(socket, req);
-        } catch (const boost::system::system_error& ex) {
-            throw NetworkError(ex.what());
-        }
-        logfile << thread_id << " has written the request.\n";
-        // Start the receive section
-        asio::streambuf response;
-        boost::system::error_code ec;
-        asio::read(socket, response, ec);
-        if (ec && ec != asio::error::eof)
-            throw NetworkError(boost::system::system_error(ec).what());
-        logfile << thread_id << " received response.\n";
-        std::istream resp_stream(&response);
-        // Now start the first line
-        int status_code = 0;
-        std::string status_msg, http_version;
-        resp_stream >> http_version >> status_code >> status_msg;
-        if (status_code != 200 && status_code != 302)
-            throw NetworkError("Fail status code: "s + std::to_string(status_code));
-        std::string lastline, currline;
-        while (resp_stream) {
-            std::getline(resp_stream, currline);
-            if (currline.back() == '\r')
-                currline.pop_back();
-            if (currline.size())
-                lastline = currline;
-        }
-        logfile << thread_id << " reports last line length: " << lastline.size() << '\n';
-        return nlohmann::json::parse(lastline);
-    }
-
-    nlohmann::json get_stu_new(
-        const Configuration& config,
-        const std::vector<Student>& absent,
-        const LessonInfo& lesson,
-        Logfile& logfile
-    ) {
-        using PromType = std::promise<nlohmann::json>;
-        std::shared_ptr<PromType> prom(new PromType());
-        auto fut = prom->get_future();
-        // For thread safety concerns, copy all the data except for the logfile one.
-        // This should copy-assign the shared pointer, so prom will still be valid if
-        // get_stu_new returns a timeout error.
-        // logfile should always be valid.
-        std::thread([&logfile, &config]
-            (std::vector<Student> absent, LessonInfo lesson, std::shared_ptr<std::promise<nlohmann::json>> prom) {
-            try {
-                prom->set_value(execute_request(config, absent, lesson, logfile));
-            } catch (...) {
-                try {
-                    prom->set_exception(std::current_exception());
-                } catch (...) {
-                    logfile << "Exception occurred in execute_request, but failed to set exception!\n" << std::flush;
-                }
-            }
-        }, absent, lesson, prom).detach();
-        auto fut_status = fut.wait_for(std::chrono::seconds(config["timeout"]));
-        if (fut_status == std::future_status::ready)
-            return fut.get();
-        else
-            throw NetworkError("execute_request timed out.");
-    }
-
-    static void send_to_gs_impl(int gs_port, std::string msg, std::shared_ptr<std::promise<std::string>> prom) {
-        namespace asio = boost::asio;
-        asio::io_context ioc;
-        asio::ip::udp::socket socket(ioc);
-        socket.open(asio::ip::udp::v4());
-        asio::ip::udp::endpoint addr(asio::ip::address::from_string("127.0.0.1"), gs_port);
-        try {
-            socket.send_to(asio::buffer(std::move(msg)), addr);
-            std::array<char, 128> buff;
-            asio::ip::udp::endpoint endpoint;
-            auto n = socket.receive_from(asio::buffer(buff), endpoint);
-            prom->set_value(std::string(buff.begin(), n));
-            return;
-        } catch (const boost::system::system_error& ex) {
-            try {
-                if (ex.code().value() == asio::error::connection_reset)
-                    throw NetworkError("Connection was reset, maybe GS not up?");
-                else
-                    throw NetworkError("Network error " + std::to_string(ex.code().value()));
-            } catch (const NetworkError& ex2) {
-                // Set it to the promise
-                try {
-                    prom->set_exception(std::current_exception());
-                } catch (...) {
-                    // Nothing to do.
-                }
-            }
-        }
-    }
-
-    void send_to_gs(const Configuration& config, Logfile& log, const std::string& msg) {
-        log << "Sending message to GS: " << msg << '\n';
-        using Promise = std::promise<std::string>;
-        std::shared_ptr<Promise> prom(new Promise());
-        auto fut = prom->get_future();
-        // Launch the detached thread
-        std::thread(&send_to_gs_impl, config["gs_port"].get<int>(), msg, prom).detach();
-        auto stat = fut.wait_for(std::chrono::seconds(2));
-        if (stat == std::future_status::ready) {
-            // This line might throw NetworkError
-            std::string_view line = std::move(fut.get());
-            if (line.substr(0, 7) != "success")
-                throw GSError(line.data());
-            // Success, return
-            return;
-        } else
-            throw NetworkError("Sending to GS timed out");
+        SPIRIT_LOG(logfile, info, "http") << "Requesting stu_new for lesson " << lesson.anpai << '\n';
+        const auto body = client.post(host, url, req_body, std::chrono::seconds(config["timeout"]));
+        SPIRIT_LOG(logfile, debug, "http") << "Received stu_new, body length: " << body.size() << '\n';
+        return parse_stu_new(body);
     }
 }
@@ -0,0 +1,141 @@
+// Implementation of the UDP control channel to GS.
+#include <boost/asio.hpp>
+#include "singd.h"
+#include <array>
+#include <deque>
+#include <future>
+
+namespace Spirit {
+    namespace asio = boost::asio;
+    using asio::ip::udp;
+
+    // A command waiting for its reply.
+    struct GSClient::Command {
+        std::string msg;
+        std::promise<std::string> result;
+    };
+
+    struct GSClient::Impl {
+        asio::io_context ioc;
+        // Keeps ioc.run() from returning while there is nothing to do.
+        asio::executor_work_guard<asio::io_context::executor_type> work{ ioc.get_executor() };
+        udp::socket socket{ ioc };
+        const udp::endpoint gs;
+        const std::chrono::milliseconds timeout;
+        asio::steady_timer timer{ ioc };
+        // The front command is in flight, the others wait for their turn.
+        // Everything below is only touched on the I/O thread.
+        std::deque<std::shared_ptr<Command>> queue;
+        std::array<char, 128> buff;
+        // Counts the sockets opened, so that a receive completing on a closed one is ignored.
+        unsigned epoch = 0;
+        std::thread thread;
+
+        Impl(int port, std::chrono::milliseconds timeout) :
+            gs(asio::ip::address_v4::loopback(), port), timeout(timeout)
+        {}
+
+        // Sends the front command on the current socket, opening one if needed.
+        void start() {
+            if (!socket.is_open()) {
+                boost::system::error_code ec;
+                socket.open(udp::v4(), ec);
+                // Connecting filters out datagrams from others and gets us
+                // an error if nobody is listening on the port.
+                if (!ec)
+                    socket.connect(gs, ec);
+                if (ec)
+                    return fail(boost::system::system_error(ec).what());
+                receive(++epoch);
+            }
+            auto cmd = queue.front();
+            timer.expires_after(timeout);
+            timer.async_wait([this, cmd](const boost::system::error_code& ec) {
+                if (!ec && is_current(cmd))
+                    fail("Sending to GS timed out");
+            });
+            socket.async_send(asio::buffer(cmd->msg), [this, cmd](const boost::system::error_code& ec, std::size_t) {
+                if (ec && is_current(cmd))
+                    fail(ec);
+            });
+        }
+
+        void receive(unsigned current) {
+            socket.async_receive(asio::buffer(buff), [this, current](const boost::system::error_code& ec, std::size_t n) {
+                // The socket was closed, a new one has its own receive going.
+                if (ec == asio::error::operation_aborted || current != epoch)
+                    return;
+                if (ec) {
+                    if (!queue.empty())
+                        fail(ec);
+                } else if (!queue.empty())
+                    // Only one command is in flight on a socket, so this is its reply.
+                    complete(std::string(buff.data(), n));
+                // Otherwise it's a late reply that nobody is waiting for.
+                if (socket.is_open())
+                    receive(current);
+            });
+        }
+
+        bool is_current(const std::shared_ptr<Command>& cmd) const noexcept {
+            return !queue.empty() && queue.front() == cmd;
+        }
+
+        void complete(std::string reply) {
+            timer.cancel();
+            queue.front()->result.set_value(std::move(reply));
+            next();
+        }
+
+        void fail(const boost::system::error_code& ec) {
+            if (ec == asio::error::connection_reset || ec == asio::error::connection_refused)
+                fail("Connection was reset, maybe GS not up?");
+            else
+                fail("Network error " + std::to_string(ec.value()));
+        }
+
+        void fail(const std::string& what) {
+            timer.cancel();
+            // GS may still answer. A new socket makes sure the answer
+            // isn't taken as the reply to the next command.
+            boost::system::error_code ignored;
+            socket.close(ignored);
+            queue.front()->result.set_exception(std::make_exception_ptr(NetworkError(what)));
+            next();
+        }
+
+        void next() {
+            queue.pop_front();
+            if (!queue.empty())
+                start();
+        }
+    };
+
+    GSClient::GSClient(const Configuration& config) :
+        mImpl(new Impl(config["gs_port"], std::chrono::milliseconds(config.value("gs_timeout", 2000))))
+    {
+        mImpl->thread = std::thread([impl = mImpl.get()]{ impl->ioc.run(); });
+    }
+
+    GSClient::~GSClient() noexcept {
+        mImpl->work.reset();
+        mImpl->ioc.stop();
+        if (mImpl->thread.joinable())
+            mImpl->thread.join();
+    }
+
+    void GSClient::send(const std::string& msg, Logfile& log) {
+        SPIRIT_LOG(log, info, "gs") << "Sending message to GS: " << msg << '\n';
+        auto cmd = std::make_shared<Command>(Command{ msg, {} });
+        auto fut = cmd->result.get_future();
+        asio::post(mImpl->ioc, [impl = mImpl.get(), cmd = std::move(cmd)]{
+            impl->queue.push_back(cmd);
+            if (impl->queue.size() == 1)
+                impl->start();
+        });
+        // This line might throw NetworkError
+        const std::string line = fut.get();
+        if (line.substr(0, 7) != "success")
+            throw GSError(line);
+    }
+}
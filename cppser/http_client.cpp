@@ -0,0 +1,209 @@
+// Implementation of the keep-alive HTTP client used for stu_new.
+#include <boost/asio.hpp>
+#include "singd.h"
+#include "http_parser.h"
+#include <array>
+#include <future>
+
+namespace Spirit {
+    namespace asio = boost::asio;
+    using asio::ip::tcp;
+
+    // stu_new answers are a few KB, anything beyond this is not what we asked for.
+    constexpr std::size_t max_body = 16 << 20;
+
+    struct HttpClient::Impl {
+        asio::io_context ioc;
+        // Keeps ioc.run() from returning while there is nothing to do.
+        asio::executor_work_guard<asio::io_context::executor_type> work{ ioc.get_executor() };
+        tcp::resolver resolver{ ioc };
+        tcp::socket socket{ ioc };
+        asio::steady_timer timer{ ioc };
+        // The host that the endpoints and the open socket belong to.
+        std::string host;
+        tcp::resolver::results_type endpoints;
+        // Only one request at a time goes over the connection.
+        std::mutex mutex;
+        std::thread thread;
+    };
+
+    // One request and its response. Lives on the I/O thread until the result is set.
+    struct HttpClient::Exchange : public std::enable_shared_from_this<Exchange> {
+        Impl& impl;
+        const std::string request;
+        const std::chrono::milliseconds timeout;
+        std::promise<std::string> result;
+        // What the socket gave us last
+        std::array<char, 8192> chunk;
+        // The decoded body goes straight in here.
+        std::string body;
+        HttpResponseParser parser;
+        // True if we are using a connection left open by an earlier request.
+        // The server might have closed it in the meantime, so we try once more on errors.
+        bool reused = false;
+        // True once some of the response has arrived, after which we can't retry.
+        bool received = false;
+        bool done = false;
+
+        Exchange(Impl& impl, std::string request, std::chrono::milliseconds timeout) :
+            impl(impl), request(std::move(request)), timeout(timeout),
+            // The parser rejects bodies over max_body.
+            parser([this](std::string_view part) { body.append(part.data(), part.size()); }, max_body)
+        {}
+
+        void start() {
+            impl.timer.expires_after(timeout);
+            impl.timer.async_wait([self = shared_from_this()](const boost::system::error_code& ec) {
+                if (!ec)
+                    self->fail("Request to the school server timed out.");
+            });
+            if (impl.socket.is_open()) {
+                reused = true;
+                write();
+            } else
+                connect();
+        }
+
+        void connect() {
+            if (!impl.endpoints.empty()) {
+                asio::async_connect(impl.socket, impl.endpoints,
+                    [self = shared_from_this()](const boost::system::error_code& ec, const tcp::endpoint&) {
+                        if (ec) {
+                            // Maybe the address has changed.
+                            self->impl.endpoints = {};
+                            return self->fail(ec);
+                        }
+                        self->write();
+                    });
+                return;
+            }
+            impl.resolver.async_resolve(impl.host, "http",
+                [self = shared_from_this()](const boost::system::error_code& ec,
+                    tcp::resolver::results_type results
+                ) {
+                    if (ec)
+                        return self->fail(ec);
+                    self->impl.endpoints = std::move(results);
+                    self->connect();
+                });
+        }
+
+        void write() {
+            asio::async_write(impl.socket, asio::buffer(request),
+                [self = shared_from_this()](const boost::system::error_code& ec, std::size_t) {
+                    if (ec)
+                        return self->retry_or_fail(ec);
+                    self->read();
+                });
+        }
+
+        void read() {
+            impl.socket.async_read_some(asio::buffer(chunk),
+                [self = shared_from_this()](const boost::system::error_code& ec, std::size_t n) {
+                    self->on_read(ec, n);
+                });
+        }
+
+        void on_read(const boost::system::error_code& ec, std::size_t n) {
+            if (ec && (ec != asio::error::eof || !received))
+                return retry_or_fail(ec);
+            received = true;
+            // Nothing may escape into ioc.run(), that would take the daemon down.
+            try {
+                if (ec)
+                    parser.feed_eof();
+                else
+                    parser.feed(std::string_view(chunk.data(), n));
+                if (parser.headers_done()) {
+                    if (parser.status() != 200 && parser.status() != 302)
+                        return fail("Fail status code: " + std::to_string(parser.status()));
+                    // At most max_body, the parser checks.
+                    if (parser.content_length() && body.capacity() < *parser.content_length())
+                        body.reserve(*parser.content_length());
+                }
+            } catch (const std::exception& ex) {
+                return fail(ex.what());
+            }
+            if (parser.done())
+                return finish();
+            read();
+        }
+
+        void finish() {
+            if (done)
+                return;
+            done = true;
+            impl.timer.cancel();
+            if (!parser.keep_alive())
+                close();
+            result.set_value(std::move(body));
+        }
+
+        void retry_or_fail(const boost::system::error_code& ec) {
+            if (!reused || received || done)
+                return fail(ec);
+            // The server has closed the idle connection, start over with a new one.
+            reused = false;
+            close();
+            connect();
+        }
+
+        void fail(const boost::system::error_code& ec) {
+            if (ec == asio::error::connection_reset)
+                fail("Connection was reset by the school server.");
+            else
+                fail(boost::system::system_error(ec).what());
+        }
+
+        void fail(const std::string& what) {
+            if (done)
+                return;
+            done = true;
+            impl.timer.cancel();
+            impl.resolver.cancel();
+            // The connection is in an unknown state, don't reuse it.
+            close();
+            result.set_exception(std::make_exception_ptr(NetworkError(what)));
+        }
+
+        void close() {
+            boost::system::error_code ignored;
+            impl.socket.close(ignored);
+        }
+    };
+
+    HttpClient::HttpClient() : mImpl(new Impl()) {
+        mImpl->thread = std::thread([impl = mImpl.get()]{ impl->ioc.run(); });
+    }
+
+    HttpClient::~HttpClient() noexcept {
+        mImpl->work.reset();
+        mImpl->ioc.stop();
+        if (mImpl->thread.joinable())
+            mImpl->thread.join();
+    }
+
+    std::string HttpClient::post(const std::string& host, const std::string& target,
+        const std::string& body, std::chrono::milliseconds timeout
+    ) {
+        std::lock_guard lock(mImpl->mutex);
+        std::string request = "POST " + target + " HTTP/1.1\r\n"
+            "Content-Type: application/json\r\n"
+            "Host: " + host + "\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "Connection: keep-alive\r\n\r\n" + body;
+        auto exchange = std::make_shared<Exchange>(*mImpl, std::move(request), timeout);
+        auto fut = exchange->result.get_future();
+        asio::post(mImpl->ioc, [exchange, host]{
+            auto& impl = exchange->impl;
+            if (impl.host != host) {
+                exchange->close();
+                impl.endpoints = {};
+                impl.host = host;
+            }
+            exchange->start();
+        });
+        // The timer makes sure that this doesn't wait much longer than timeout.
+        return fut.get();
+    }
+}
@@ -0,0 +1,208 @@
+#include "http_parser.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+
+namespace Spirit {
+    namespace {
+        // Header lines are short, anything longer is not what we're expecting.
+        constexpr std::size_t max_line = 8192;
+
+        bool iequals(std::string_view a, std::string_view b) {
+            return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(),
+                [](unsigned char x, unsigned char y) { return std::tolower(x) == std::tolower(y); });
+        }
+
+        // Parses all of text as an unsigned number. Unlike std::stoul, signs, spaces,
+        // trailing garbage and overflows are errors. Returns false on errors.
+        template <typename T>
+        bool parse_number(std::string_view text, T& value, int base = 10) {
+            const auto end = text.data() + text.size();
+            if (text.empty() || !std::isxdigit(static_cast<unsigned char>(text.front())))
+                return false;
+            const auto [ptr, ec] = std::from_chars(text.data(), end, value, base);
+            return ec == std::errc() && ptr == end;
+        }
+
+        // Returns true if the comma separated list contains token, ignoring case.
+        bool has_token(std::string_view list, std::string_view token) {
+            while (!list.empty()) {
+                const auto comma = std::min(list.find(','), list.size());
+                auto item = list.substr(0, comma);
+                while (!item.empty() && item.front() == ' ')
+                    item.remove_prefix(1);
+                while (!item.empty() && item.back() == ' ')
+                    item.remove_suffix(1);
+                if (iequals(item, token))
+                    return true;
+                list.remove_prefix(std::min(comma + 1, list.size()));
+            }
+            return false;
+        }
+    }
+
+    HttpResponseParser::HttpResponseParser(BodySink sink, std::size_t max_body) :
+        mSink(std::move(sink)), mMaxBody(max_body)
+    {}
+
+    std::size_t HttpResponseParser::feed(std::string_view data) {
+        std::size_t used = 0;
+        while (used < data.size() && mState != State::done) {
+            const auto rest = data.substr(used);
+            if (mState == State::body || mState == State::chunk_data || mState == State::until_eof) {
+                const std::size_t n = mState == State::until_eof ? rest.size()
+                    : std::min(mRemaining, rest.size());
+                add_body(n);
+                mSink(rest.substr(0, n));
+                used += n;
+                if (mState == State::until_eof)
+                    continue;
+                mRemaining -= n;
+                if (mRemaining == 0)
+                    mState = mState == State::body ? State::done : State::chunk_end;
+            } else {
+                bool complete = false;
+                used += take_line(rest, complete);
+                if (complete) {
+                    on_line();
+                    mLine.clear();
+                }
+            }
+        }
+        return used;
+    }
+
+    void HttpResponseParser::feed_eof() {
+        if (mState == State::until_eof)
+            mState = State::done;
+        else if (mState != State::done)
+            throw HttpParseError("Connection closed before the response was complete.");
+    }
+
+    bool HttpResponseParser::done() const noexcept {
+        return mState == State::done;
+    }
+
+    bool HttpResponseParser::headers_done() const noexcept {
+        return mState != State::status_line && mState != State::header;
+    }
+
+    int HttpResponseParser::status() const noexcept {
+        return mStatus;
+    }
+
+    bool HttpResponseParser::keep_alive() const noexcept {
+        return mKeepAlive;
+    }
+
+    std::optional<std::size_t> HttpResponseParser::content_length() const noexcept {
+        return mLength;
+    }
+
+    std::size_t HttpResponseParser::take_line(std::string_view data, bool& complete) {
+        const auto lf = data.find('\n');
+        complete = lf != std::string_view::npos;
+        const std::size_t used = complete ? lf + 1 : data.size();
+        mLine.append(data.data(), complete ? lf : used);
+        if (mLine.size() > max_line)
+            throw HttpParseError("HTTP header line too long.");
+        if (complete && !mLine.empty() && mLine.back() == '\r')
+            mLine.pop_back();
+        return used;
+    }
+
+    void HttpResponseParser::on_line() {
+        switch (mState) {
+        case State::status_line: {
+            // HTTP/1.1 200 OK
+            if (mLine.compare(0, 5, "HTTP/") != 0 || mLine.size() < 12 || mLine[8] != ' ')
+                throw HttpParseError("Bad status line: " + mLine);
+            mKeepAlive = mLine.compare(0, 8, "HTTP/1.1") == 0;
+            if (!parse_number(std::string_view(mLine).substr(9, 3), mStatus))
+                throw HttpParseError("Bad status line: " + mLine);
+            mState = State::header;
+            break;
+        }
+        case State::header: {
+            if (mLine.empty())
+                return on_headers_end();
+            const auto colon = mLine.find(':');
+            if (colon == std::string::npos)
+                throw HttpParseError("Bad header line: " + mLine);
+            const std::string_view name(mLine.data(), colon);
+            std::string_view value(mLine);
+            value.remove_prefix(colon + 1);
+            while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+                value.remove_prefix(1);
+            while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+                value.remove_suffix(1);
+            if (iequals(name, "Content-Length")) {
+                std::size_t length = 0;
+                if (!parse_number(value, length))
+                    throw HttpParseError("Bad Content-Length: " + mLine);
+                if (length > mMaxBody)
+                    throw HttpParseError("Response body too large: " + mLine);
+                mLength = length;
+            }
+            else if (iequals(name, "Transfer-Encoding"))
+                mChunked = has_token(value, "chunked");
+            else if (iequals(name, "Connection")) {
+                if (has_token(value, "close"))
+                    mKeepAlive = false;
+                else if (has_token(value, "keep-alive"))
+                    mKeepAlive = true;
+            }
+            break;
+        }
+        case State::chunk_size: {
+            // Chunk extensions after ';' are ignored.
+            auto size = std::string_view(mLine).substr(0, mLine.find(';'));
+            while (!size.empty() && (size.back() == ' ' || size.back() == '\t'))
+                size.remove_suffix(1);
+            if (!parse_number(size, mRemaining, 16))
+                throw HttpParseError("Bad chunk size: " + mLine);
+            if (mRemaining > mMaxBody - mBodySize)
+                throw HttpParseError("Response body too large.");
+            mState = mRemaining ? State::chunk_data : State::trailer;
+            break;
+        }
+        case State::chunk_end:
+            if (!mLine.empty())
+                throw HttpParseError("Chunk is longer than announced.");
+            mState = State::chunk_size;
+            break;
+        case State::trailer:
+            if (mLine.empty())
+                mState = State::done;
+            break;
+        default:
+            break;
+        }
+    }
+
+    void HttpResponseParser::on_headers_end() {
+        if (mStatus >= 100 && mStatus < 200) {
+            // Interim response like 100 Continue, the real one follows.
+            *this = HttpResponseParser(std::move(mSink), mMaxBody);
+            return;
+        }
+        if (mStatus == 204 || mStatus == 304)
+            mState = State::done;
+        else if (mChunked)
+            mState = State::chunk_size;
+        else if (mLength) {
+            mRemaining = *mLength;
+            mState = mRemaining ? State::body : State::done;
+        } else {
+            // The body ends when the server closes the connection.
+            mKeepAlive = false;
+            mState = State::until_eof;
+        }
+    }
+
+    void HttpResponseParser::add_body(std::size_t n) {
+        if (n > mMaxBody - mBodySize)
+            throw HttpParseError("Response body too large.");
+        mBodySize += n;
+    }
+}
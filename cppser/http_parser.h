@@ -0,0 +1,82 @@
+#ifndef SPIRIT_HTTP_PARSER_H
+#define SPIRIT_HTTP_PARSER_H
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace Spirit {
+    // Thrown when the response doesn't look like HTTP, or its body is too large.
+    struct HttpParseError : public std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
+
+    // Incremental parser for one HTTP/1.1 response. Feed it the bytes as they arrive
+    // from the socket. The body, delimited by Content-Length, chunked encoding or EOF,
+    // is decoded and handed to the sink piece by piece. Only a partial header line is
+    // ever buffered.
+    class HttpResponseParser {
+    public:
+        // Called with the decoded body bytes, in order.
+        using BodySink = std::function<void(std::string_view)>;
+
+        // Bodies longer than max_body bytes are rejected.
+        explicit HttpResponseParser(BodySink sink, std::size_t max_body = default_max_body);
+
+        static constexpr std::size_t default_max_body = 64 << 20;
+
+        // Consumes data and returns the number of bytes used. That is less than data.size()
+        // only if the response is complete, the rest belongs to the next response.
+        // Throws HttpParseError on malformed input.
+        std::size_t feed(std::string_view data);
+
+        // Tells the parser that the server has closed the connection. This completes
+        // a body delimited by EOF, otherwise throws HttpParseError.
+        void feed_eof();
+
+        // True once the whole response has been parsed.
+        bool done() const noexcept;
+
+        // True once the status line and headers have been parsed.
+        bool headers_done() const noexcept;
+
+        // These are valid once headers_done() is true.
+        int status() const noexcept;
+        bool keep_alive() const noexcept;
+        std::optional<std::size_t> content_length() const noexcept;
+    private:
+        enum class State {
+            status_line, header, body, chunk_size, chunk_data, chunk_end, trailer, until_eof, done
+        };
+        BodySink mSink;
+        std::size_t mMaxBody;
+        // Decoded body bytes so far
+        std::size_t mBodySize = 0;
+        State mState = State::status_line;
+        // The header line being assembled
+        std::string mLine;
+        // Bytes left in the body or the current chunk
+        std::size_t mRemaining = 0;
+        int mStatus = 0;
+        bool mKeepAlive = true;
+        bool mChunked = false;
+        std::optional<std::size_t> mLength;
+
+        // Appends to mLine until a LF. Returns the bytes used and sets complete if the
+        // line is complete, in which case mLine holds it without the CRLF.
+        std::size_t take_line(std::string_view data, bool& complete);
+
+        // Handles the complete line in mLine according to mState.
+        void on_line();
+
+        // Called after the blank line ending the headers.
+        void on_headers_end();
+
+        // Counts n more body bytes, throws HttpParseError beyond mMaxBody.
+        void add_body(std::size_t n);
+    };
+}
+
+#endif
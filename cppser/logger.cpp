@@ -1,12 +1,462 @@
 #include "logger.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
 #include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef SPIRIT_LOG_GZIP
+#include <zlib.h>
+#endif
 
 namespace Spirit {
-	Logfile::Logfile(const std::string& file, std::ios::openmode mode) : mFile(file, mode)
+	namespace {
+		// The number of records that fit in the ring buffer, a power of two.
+		constexpr std::size_t ring_size = 4096;
+		// The writer hands about this much to the stream at a time.
+		constexpr std::size_t batch_size = 64 * 1024;
+		// Unflushed records are flushed after this long.
+		constexpr std::chrono::seconds flush_interval(1);
+
+		// The current second, as asctime() followed by a space for text records
+		// and as ISO 8601 for JSON records.
+		// Each thread only formats it again when the second changes.
+		struct Timestamp {
+			std::time_t cached = -1;
+			std::string text, iso;
+		};
+
+		const Timestamp& timestamp() {
+			thread_local Timestamp ts;
+			const auto now = std::time(nullptr);
+			if (now != ts.cached) {
+				// localtime() and asctime() share static buffers.
+				static std::mutex mutex;
+				std::lock_guard lock(mutex);
+				const auto tm = std::localtime(&now);
+				char iso[32];
+				std::strftime(iso, sizeof(iso), "%Y-%m-%dT%H:%M:%S", tm);
+				ts.iso = iso;
+				ts.text = std::asctime(tm);
+				ts.text.back() = ' ';
+				ts.cached = now;
+			}
+			return ts;
+		}
+
+		// Cuts msg to about max bytes without splitting a UTF-8 character.
+		void truncate(std::string& msg, std::size_t max) {
+			if (max == 0 || msg.size() <= max)
+				return;
+			const auto size = msg.size();
+			const bool newline = msg.back() == '\n';
+			while (max > 0 && (static_cast<unsigned char>(msg[max]) & 0xC0) == 0x80)
+				max--;
+			msg.resize(max);
+			msg += "... (" + std::to_string(size) + " bytes)";
+			if (newline)
+				msg += '\n';
+		}
+
+		// Compresses src into dest. Returns false on errors.
+		bool gzip_file([[maybe_unused]] const std::string& src, [[maybe_unused]] const std::string& dest) {
+#ifdef SPIRIT_LOG_GZIP
+			std::ifstream in(src, std::ios::binary);
+			if (!in)
+				return false;
+			const gzFile out = gzopen(dest.c_str(), "wb");
+			if (!out)
+				return false;
+			std::vector<char> buf(batch_size);
+			bool good = true;
+			while (good && (in.read(buf.data(), buf.size()) || in.gcount() > 0)) {
+				const auto n = static_cast<int>(in.gcount());
+				good = gzwrite(out, buf.data(), n) == n;
+			}
+			return gzclose(out) == Z_OK && good && in.eof();
+#else
+			return false;
+#endif
+		}
+
+		// Appends str to out as a JSON string. Bytes above 0x7f are copied as they are.
+		void append_json(std::string& out, std::string_view str) {
+			out += '"';
+			for (const char c : str) {
+				switch (c) {
+				case '"': out += "\\\""; break;
+				case '\\': out += "\\\\"; break;
+				case '\n': out += "\\n"; break;
+				case '\r': out += "\\r"; break;
+				case '\t': out += "\\t"; break;
+				default:
+					if (static_cast<unsigned char>(c) < 0x20) {
+						char buf[8];
+						std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(c));
+						out += buf;
+					} else
+						out += c;
+				}
+			}
+			out += '"';
+		}
+	}
+
+	const char* to_string(LogLevel level) noexcept {
+		switch (level) {
+		case LogLevel::debug: return "debug";
+		case LogLevel::info: return "info";
+		case LogLevel::warn: return "warn";
+		case LogLevel::error: return "error";
+		}
+		return "unknown";
+	}
+
+	struct Logfile::Backend {
+		// The ring buffer is Vyukov's bounded queue with a single consumer.
+		// A slot whose seq equals pos is free for the producer claiming pos,
+		// and seq == pos + 1 means it holds the record for pos.
+		struct Slot {
+			std::atomic<std::size_t> seq;
+			std::string record;
+			bool flush = false;
+		};
+
+		std::ofstream file;
+		const LogOptions options;
+		// Records seen for each category in options.limits, for sampling.
+		std::map<std::string, std::atomic<unsigned long>, std::less<>> seen;
+		std::unique_ptr<Slot[]> ring{ new Slot[ring_size] };
+		// The next position for producers to claim.
+		std::atomic<std::size_t> head{ 0 };
+		// The next position for the writer to take. Only touched by the writer.
+		std::size_t tail = 0;
+		// Set by request_flush().
+		std::atomic_bool flush_hint{ false };
+		// Tickets handed out by flush(), and the last one done, guarded by mutex.
+		std::atomic<unsigned long> flush_requested{ 0 };
+		unsigned long flush_done = 0;
+		std::atomic_bool stop{ false };
+		// True while the writer waits for records, only then do producers have to notify it.
+		std::atomic_bool idle{ false };
+		std::mutex mutex;
+		std::condition_variable cond, flushed;
+		std::thread writer;
+
+		// The file being written, only touched by the writer.
+		std::string name;
+		// Its place in the rotation ring.
+		std::size_t index = 0;
+		std::uint64_t written = 0;
+		std::chrono::steady_clock::time_point opened = std::chrono::steady_clock::now();
+
+		// Rotated files waiting for the compressor, guarded by compress_mutex.
+		std::deque<std::string> to_compress;
+		bool compress_stop = false;
+		std::mutex compress_mutex;
+		std::condition_variable compress_cond;
+		std::thread compressor;
+
+		Backend(const std::string& name, std::ios::openmode mode, LogOptions options) :
+			file(name, mode), options(std::move(options)), name(name)
+		{
+			for (auto&& [category, limit] : this->options.limits)
+				seen.try_emplace(category, 0);
+			for (std::size_t i = 0; i < ring_size; i++)
+				ring[i].seq.store(i, std::memory_order_relaxed);
+			const auto& rotation = this->options.rotation;
+			if (rotation.keep == 0)
+				return;
+			// Appending continues the file.
+			std::error_code ec;
+			if (mode & std::ios::app)
+				written = std::filesystem::file_size(name, ec);
+			if (ec)
+				written = 0;
+			// Carry on from our place in the ring, if the name came from select_logfile().
+			if (name.compare(0, rotation.base.size(), rotation.base) == 0)
+				index = std::strtoul(name.c_str() + rotation.base.size(), nullptr, 10) % rotation.keep;
+		}
+
+		void push(std::string record, bool flush) {
+			auto pos = head.load(std::memory_order_relaxed);
+			Slot* slot;
+			while (true) {
+				slot = &ring[pos & (ring_size - 1)];
+				const auto seq = slot->seq.load(std::memory_order_acquire);
+				const auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+				if (diff == 0) {
+					if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				} else if (diff < 0) {
+					// Full, let the writer catch up.
+					wake();
+					std::this_thread::yield();
+					pos = head.load(std::memory_order_relaxed);
+				} else
+					pos = head.load(std::memory_order_relaxed);
+			}
+			slot->record = std::move(record);
+			slot->flush = flush;
+			slot->seq.store(pos + 1, std::memory_order_release);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (idle.load(std::memory_order_relaxed))
+				wake();
+		}
+
+		// Appends the next record to batch. Returns false if there is none yet.
+		bool pop(std::string& batch, bool& flush) {
+			auto& slot = ring[tail & (ring_size - 1)];
+			if (slot.seq.load(std::memory_order_acquire) != tail + 1)
+				return false;
+			batch += slot.record;
+			flush |= slot.flush;
+			// Give the memory back, some records are whole JSON dumps.
+			std::string().swap(slot.record);
+			slot.seq.store(tail + ring_size, std::memory_order_release);
+			tail++;
+			return true;
+		}
+
+		void wake() {
+			std::lock_guard lock(mutex);
+			cond.notify_one();
+		}
+
+		void run() {
+			std::string batch;
+			batch.reserve(batch_size);
+			auto last_flush = std::chrono::steady_clock::now();
+			bool dirty = false;
+			while (true) {
+				// Read before taking the records, so that a ticket is only done
+				// after what was logged before it.
+				const auto requested = flush_requested.load();
+				bool flush = flush_hint.exchange(false);
+				batch.clear();
+				while (batch.size() < batch_size && pop(batch, flush))
+					;
+				if (!batch.empty()) {
+					file.write(batch.data(), batch.size());
+					written += batch.size();
+					dirty = true;
+				}
+				const bool drained = tail == head.load(std::memory_order_acquire);
+				const auto now = std::chrono::steady_clock::now();
+				if (dirty && (flush || requested != flush_done || now - last_flush >= flush_interval)) {
+					file.flush();
+					dirty = false;
+					last_flush = now;
+				}
+				if (rotation_due(now))
+					rotate(now);
+				if (drained && requested != flush_done) {
+					std::lock_guard lock(mutex);
+					flush_done = requested;
+					flushed.notify_all();
+				}
+				if (!batch.empty())
+					continue;
+				if (!drained) {
+					// A producer has claimed a slot but not filled it yet.
+					std::this_thread::yield();
+					continue;
+				}
+				if (stop)
+					break;
+				std::unique_lock lock(mutex);
+				idle = true;
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				// Look again now that producers will notify us.
+				if (head.load() == tail && flush_requested.load() == flush_done
+					&& !flush_hint && !stop)
+					cond.wait_for(lock, flush_interval);
+				idle = false;
+			}
+			file.flush();
+		}
+
+		bool rotation_due(std::chrono::steady_clock::time_point now) const noexcept {
+			const auto& rotation = options.rotation;
+			if (rotation.keep == 0 || written == 0)
+				return false;
+			return (rotation.max_bytes && written >= rotation.max_bytes)
+				|| (rotation.max_age.count() && now - opened >= rotation.max_age);
+		}
+
+		// Closes the file and opens the next one in the ring, leaving the old one
+		// to the compressor if asked to.
+		void rotate(std::chrono::steady_clock::time_point now) {
+			const auto& rotation = options.rotation;
+			file.close();
+			if (rotation.compress) {
+				// Moved out of the way, in case the ring comes back to this name
+				// before the compressor is done with it.
+				std::error_code ec;
+				std::filesystem::rename(name, name + ".pending", ec);
+				if (!ec) {
+					std::lock_guard lock(compress_mutex);
+					to_compress.push_back(name);
+					compress_cond.notify_one();
+				}
+			}
+			index = (index + 1) % rotation.keep;
+			name = rotation.base + std::to_string(index) + ".log";
+			file.open(name, std::ios::out | std::ios::trunc);
+			written = 0;
+			opened = now;
+		}
+
+		// The compressor thread. Turns <name>.pending into <name>.gz.
+		void compress_all() {
+			std::unique_lock lock(compress_mutex);
+			while (true) {
+				compress_cond.wait(lock, [this]{ return compress_stop || !to_compress.empty(); });
+				if (to_compress.empty())
+					return;
+				const auto target = std::move(to_compress.front());
+				to_compress.pop_front();
+				lock.unlock();
+				const auto pending = target + ".pending";
+				std::error_code ec;
+				if (gzip_file(pending, target + ".gz"))
+					std::filesystem::remove(pending, ec);
+				else {
+					// Keep it uncompressed, unless the ring has already reused the name.
+					std::filesystem::remove(target + ".gz", ec);
+					if (!std::filesystem::exists(target, ec))
+						std::filesystem::rename(pending, target, ec);
+				}
+				lock.lock();
+			}
+		}
+	};
+
+	LogLine::LogLine(Logfile& file) : mFile(&file)
+	{}
+
+	LogLine::LogLine(Logfile& file, LogLevel level, std::string_view category) :
+		mFile(&file), mCategory(category), mLevel(level)
 	{}
 
+	LogLine::LogLine(LogLine&& src) :
+		mFile(src.mFile), mBuffer(std::move(src.mBuffer)), mFlush(src.mFlush),
+		mCategory(src.mCategory), mLevel(src.mLevel)
+	{
+		src.mFile = nullptr;
+	}
+
+	LogLine& LogLine::operator << (std::ostream& (*manip)(std::ostream&)) {
+		using Manip = std::ostream& (*)(std::ostream&);
+		if (manip == static_cast<Manip>(std::endl) || manip == static_cast<Manip>(std::flush))
+			mFlush = true;
+		mBuffer << manip;
+		return *this;
+	}
+
+	LogLine::~LogLine() noexcept {
+		if (!mFile)
+			return;
+		try {
+			mFile->submit(*this);
+		} catch (...) {
+			// Out of memory, the record is lost.
+		}
+	}
+
+	Logfile::Logfile(const std::string& file, std::ios::openmode mode, LogOptions options) :
+		mBackend(new Backend(file, mode, std::move(options)))
+	{
+		mBackend->writer = std::thread([backend = mBackend.get()]{ backend->run(); });
+		const auto& rotation = mBackend->options.rotation;
+		if (rotation.keep && rotation.compress)
+			mBackend->compressor = std::thread([backend = mBackend.get()]{ backend->compress_all(); });
+	}
+
+	Logfile::~Logfile() noexcept {
+		if (!mBackend)
+			return;
+		mBackend->stop = true;
+		mBackend->wake();
+		mBackend->writer.join();
+		if (mBackend->compressor.joinable()) {
+			// Let it finish the files it has been given.
+			{
+				std::lock_guard lock(mBackend->compress_mutex);
+				mBackend->compress_stop = true;
+			}
+			mBackend->compress_cond.notify_one();
+			mBackend->compressor.join();
+		}
+	}
+
+	bool Logfile::enabled(LogLevel level, std::string_view category) noexcept {
+		if (level < mBackend->options.level)
+			return false;
+		const auto limit = mBackend->options.limits.find(category);
+		if (limit == mBackend->options.limits.end() || limit->second.sample <= 1)
+			return true;
+		const auto n = mBackend->seen.find(category)->second.fetch_add(1, std::memory_order_relaxed);
+		return n % limit->second.sample == 0;
+	}
+
+	LogLine Logfile::line(LogLevel level, std::string_view category) {
+		return LogLine(*this, level, category);
+	}
+
+	void Logfile::submit(LogLine& line) {
+		const auto& options = mBackend->options;
+		const auto& ts = timestamp();
+		std::string msg = line.mBuffer.str();
+		if (!line.mCategory.empty()) {
+			if (auto limit = options.limits.find(line.mCategory); limit != options.limits.end())
+				truncate(msg, limit->second.max_bytes);
+		}
+		std::string record;
+		if (options.json) {
+			if (!msg.empty() && msg.back() == '\n')
+				msg.pop_back();
+			record.reserve(msg.size() + 80);
+			record += "{\"time\":\"";
+			record += ts.iso;
+			record += "\",\"level\":\"";
+			record += to_string(line.mLevel);
+			record += "\",\"category\":";
+			append_json(record, line.mCategory);
+			record += ",\"message\":";
+			append_json(record, msg);
+			record += "}\n";
+		} else if (line.mCategory.empty())
+			record = ts.text + msg;
+		else {
+			record.reserve(ts.text.size() + line.mCategory.size() + msg.size() + 12);
+			record += ts.text;
+			record += '[';
+			record += to_string(line.mLevel);
+			record += "] ";
+			record += line.mCategory;
+			record += ": ";
+			record += msg;
+		}
+		mBackend->push(std::move(record), line.mFlush);
+	}
+
 	void Logfile::flush() {
-		mFile.flush();
+		const auto ticket = ++mBackend->flush_requested;
+		std::unique_lock lock(mBackend->mutex);
+		mBackend->cond.notify_one();
+		mBackend->flushed.wait(lock, [&]{ return mBackend->flush_done >= ticket; });
+	}
+
+	void Logfile::request_flush() noexcept {
+		mBackend->flush_hint = true;
+		if (mBackend->idle)
+			mBackend->wake();
 	}
 
 	LogSection::LogSection(Logfile& file) : mFile(&file)
@@ -23,9 +473,9 @@ namespace Spirit {
 	}
 
 	LogSection::~LogSection() noexcept {
-		mFile->flush();
+		if (mFile)
+			mFile->request_flush();
 	}
-
 	std::string select_logfile(const std::string& base, std::size_t lognum) {
 		namespace stdfs = std::filesystem;
 		if (lognum == 0)
@@ -1,52 +1,183 @@
 #ifndef SPIRIT_LOGGER_H
 #define SPIRIT_LOGGER_H
+#include <chrono>
+#include <cstdint>
 #include <fstream>
-#include <ctime>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <filesystem>
+#include <map>
+#include <memory>
+
+// Records below this level are removed at compile time by SPIRIT_LOG.
+// 0 is debug, 1 info, 2 warn and 3 error.
+#ifndef SPIRIT_LOG_MIN_LEVEL
+#define SPIRIT_LOG_MIN_LEVEL 0
+#endif
+
+// Writes a record of the given level (debug, info, warn or error) and category to file:
+//     SPIRIT_LOG(log, debug, "request") << from << ": " << request.dump() << '\n';
+// If the record is compiled out, or filtered out by the file's options, the operands
+// are not even evaluated. Being an expression, it is safe in an unbraced if.
+#define SPIRIT_LOG(file, level, category) \
+	!(static_cast<int>(::Spirit::LogLevel::level) >= SPIRIT_LOG_MIN_LEVEL \
+		&& (file).enabled(::Spirit::LogLevel::level, category)) \
+	? (void)0 : ::Spirit::LogVoidify() & (file).line(::Spirit::LogLevel::level, category)
 
 namespace Spirit {
+	class Logfile;
+
+	enum class LogLevel { debug, info, warn, error };
+
+	// Returns the name of level, like "info".
+	const char* to_string(LogLevel level) noexcept;
+
+	// Limits for the records of one category, meant for the payload dumps.
+	struct LogLimit {
+		// Only one in every sample records is written.
+		unsigned sample = 1;
+		// Records longer than this many bytes are cut, 0 for no limit.
+		std::size_t max_bytes = 0;
+	};
+
+	// When a Logfile moves on to the next file of its select_logfile() ring.
+	struct LogRotation {
+		// The ring is <base>0.log to <base><keep - 1>.log. No rotation if keep is 0.
+		std::string base;
+		std::size_t keep = 0;
+		// Rotate once the file is this large, 0 for no limit.
+		std::uint64_t max_bytes = 0;
+		// Rotate once the file has been written to for this long, 0 for no limit.
+		std::chrono::seconds max_age{ 0 };
+		// Compress the file left behind to <base><num>.log.gz on another thread.
+		// Only available if built with SPIRIT_LOG_GZIP.
+		bool compress = false;
+	};
+
+	// How a Logfile filters and formats its records.
+	struct LogOptions {
+		// Records below this level are dropped.
+		LogLevel level = LogLevel::info;
+		// Writes one JSON object per line instead of plain text.
+		bool json = false;
+		// Categories that aren't here have no limits.
+		std::map<std::string, LogLimit, std::less<>> limits;
+		LogRotation rotation;
+	};
+
+	// One record being written to a Logfile, created by operator << (Logfile&, ...)
+	// or SPIRIT_LOG. The record is formatted here, on the caller's thread, and handed
+	// to the file's writer thread in one piece at the end of the full expression,
+	// so records written by different threads don't interleave:
+	//     log << "Received " << n << " bytes\n";
+	class LogLine {
+	public:
+		// A record without level and category, as written by operator <<.
+		explicit LogLine(Logfile& file);
+
+		// category must outlive this, string literals are fine.
+		LogLine(Logfile& file, LogLevel level, std::string_view category);
+
+		// Returned by value from operator <<, only the last owner submits the record.
+		LogLine(LogLine&& src);
+		LogLine& operator = (LogLine&&) = delete;
+
+		template <typename T>
+		LogLine& operator << (const T& t);
+
+		// For manipulators like std::endl and std::flush.
+		// Those two ask the writer to flush once the record is written.
+		LogLine& operator << (std::ostream& (*manip)(std::ostream&));
+
+		// Submits the record.
+		~LogLine() noexcept;
+	private:
+		// Null after being moved from.
+		Logfile* mFile;
+		std::ostringstream mBuffer;
+		bool mFlush = false;
+		// Empty for records written by operator <<.
+		std::string_view mCategory;
+		LogLevel mLevel = LogLevel::info;
+
+		friend class Logfile;
+	};
+
+	// A log file written by a background thread. Writing a record only formats it and
+	// puts it into a lock-free ring buffer, the writer thread takes the records out
+	// in batches and does the file I/O. The file is flushed when a record or a LogSection
+	// asks for it, and otherwise about once a second.
+	// If the options say so, the writer also rotates the file when it gets too large
+	// or too old, so a long running daemon doesn't fill the disk.
+	// Records written with operator << are always kept, the options only apply
+	// to the ones written with SPIRIT_LOG.
 	class Logfile {
 	public:
 		// Constructs a log file named filename
 		// The openmode can be manually chosen.
-		explicit Logfile(const std::string& name, std::ios::openmode mode = std::ios::out);
+		explicit Logfile(const std::string& name, std::ios::openmode mode = std::ios::out,
+			LogOptions options = LogOptions());
 
 		template <typename T>
-		friend std::ofstream& operator << (Logfile& file, const T& t);
+		friend LogLine operator << (Logfile& file, const T& t);
+
+		// Returns true if a record of level and category should be written.
+		// Counts the record for sampling, so call it once per record. Use SPIRIT_LOG.
+		bool enabled(LogLevel level, std::string_view category) noexcept;
+
+		// Starts a record that has passed enabled(). Use SPIRIT_LOG.
+		LogLine line(LogLevel level, std::string_view category);
 
-		// Flushes the underlying stream. Use LogSection for this.
+		// Waits until everything logged so far is written and flushed.
+		// Thread safe, like writing records.
 		void flush();
 
-		// Destructor, closes the stream. Actually this is not noexcept,
-		// but we are going to ignore that possibility.
-		virtual ~Logfile() noexcept = default;
+		// Asks the writer to flush soon, without waiting. Use LogSection for this.
+		void request_flush() noexcept;
+
+		// Writes out the remaining records and closes the file.
+		virtual ~Logfile() noexcept;
 
 		// Copy is prohibited.
 		Logfile(const Logfile&) = delete;
 		Logfile& operator = (const Logfile&) = delete;
 
-		// Move is defaulted.
+		// Move is defaulted. Don't move a file that is being written to.
 		Logfile(Logfile&&) = default;
 		Logfile& operator = (Logfile&&) = default;
 	private:
-		std::ofstream mFile;
+		// The ring buffer and the writer thread.
+		struct Backend;
+		std::unique_ptr<Backend> mBackend;
+
+		// Formats the finished record and puts it into the ring buffer.
+		void submit(LogLine& line);
+
+		friend class LogLine;
+	};
+
+	// Lets SPIRIT_LOG turn a record into void, & binds looser than <<.
+	struct LogVoidify {
+		void operator & (const LogLine&) noexcept {}
 	};
 
 	// Template, impl must be in header
 	template <typename T>
-	std::ofstream& operator << (Logfile& file, const T& t) {
-		const auto ct = []{
-			auto t = std::time(nullptr);
-			return std::localtime(&t);
-		}();
-		std::string ts = std::asctime(ct);
-		ts.back() = ' ';
-		file.mFile << ts << t;
-		return file.mFile;
+	LogLine operator << (Logfile& file, const T& t) {
+		LogLine line(file);
+		line << t;
+		return line;
+	}
+
+	template <typename T>
+	LogLine& LogLine::operator << (const T& t) {
+		mBuffer << t;
+		return *this;
 	}
 
 	// RAII type for a section after which the log should be flushed.
+	// The flush is done by the writer thread, so leaving the section doesn't wait for it.
 	class LogSection {
 	public:
 		// Initializes the log section with the log file.
@@ -60,7 +191,7 @@ namespace Spirit {
 		LogSection(LogSection&& src);
 		LogSection& operator = (LogSection&& src);
 
-		// Destructor flushes the stream
+		// Destructor asks for a flush
 		virtual ~LogSection() noexcept;
 	private:
 		// Non-owning pointer to the logfile
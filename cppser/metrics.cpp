@@ -0,0 +1,133 @@
+#include "metrics.h"
+#include <algorithm>
+
+namespace Spirit {
+    namespace {
+        // Bucket i holds latencies from bucket_floor(i) microseconds up to the next floor.
+        std::size_t bucket_of(std::uint64_t us) noexcept {
+            us = std::max<std::uint64_t>(us, 1);
+            int msb = 63;
+            while (!(us >> msb))
+                msb--;
+            // The two bits below the leading one pick one of four buckets.
+            const auto quarter = msb >= 2 ? (us >> (msb - 2)) & 3 : (us << (2 - msb)) & 3;
+            return msb * 4 + quarter;
+        }
+
+        double bucket_floor(std::size_t i) noexcept {
+            return (4 + i % 4) * static_cast<double>(std::uint64_t(1) << (i / 4)) / 4;
+        }
+
+        const char* const commands[] = {
+            "report_absent", "write_record", "restart_gs", "today_info",
+            "flush_notice", "doggie_stick", "stats", "batch"
+        };
+        const char* const phases[] = { "schedule", "stu_new", "simul_sign", "local_sign" };
+    }
+
+    void Histogram::record(std::chrono::steady_clock::duration elapsed) noexcept {
+        const auto us = static_cast<std::uint64_t>(std::max<std::int64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(), 0));
+        mBuckets[std::min(bucket_of(us), bucket_count - 1)].fetch_add(1, std::memory_order_relaxed);
+        mCount.fetch_add(1, std::memory_order_relaxed);
+        auto max = mMaxUs.load(std::memory_order_relaxed);
+        while (us > max && !mMaxUs.compare_exchange_weak(max, us, std::memory_order_relaxed))
+            ;
+    }
+
+    std::uint64_t Histogram::count() const noexcept {
+        return mCount.load(std::memory_order_relaxed);
+    }
+
+    double Histogram::quantile(double q) const noexcept {
+        // The buckets are read one by one while others may record, so the total
+        // is taken from them rather than from mCount.
+        std::array<std::uint64_t, bucket_count> counts;
+        std::uint64_t total = 0;
+        for (std::size_t i = 0; i < bucket_count; i++)
+            total += counts[i] = mBuckets[i].load(std::memory_order_relaxed);
+        if (total == 0)
+            return 0;
+        const auto rank = std::max<std::uint64_t>(static_cast<std::uint64_t>(q * total + 0.5), 1);
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; i++) {
+            seen += counts[i];
+            if (seen >= rank)
+                // The middle of the bucket, but not beyond the maximum.
+                return std::min((bucket_floor(i) + bucket_floor(i + 1)) / 2, max() * 1000) / 1000;
+        }
+        return max();
+    }
+
+    double Histogram::max() const noexcept {
+        return mMaxUs.load(std::memory_order_relaxed) / 1000.0;
+    }
+
+    Metrics::Metrics() : mStart(std::chrono::steady_clock::now()) {
+        for (auto name : commands)
+            mCommands.try_emplace(name);
+        for (auto name : phases)
+            mPhases.try_emplace(name);
+    }
+
+    Series* Metrics::command(std::string_view name) noexcept {
+        const auto it = mCommands.find(name);
+        return it == mCommands.end() ? nullptr : &it->second;
+    }
+
+    Series* Metrics::phase(std::string_view name) noexcept {
+        const auto it = mPhases.find(name);
+        return it == mPhases.end() ? nullptr : &it->second;
+    }
+
+    std::int64_t Metrics::uptime() const noexcept {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - mStart).count();
+    }
+
+    nlohmann::json Metrics::to_json() const {
+        auto dump = [](const std::map<std::string, Series, std::less<>>& group) {
+            auto ans = nlohmann::json::object();
+            for (auto&& [name, series] : group) {
+                const auto& latency = series.latency;
+                ans[name] = {
+                    { "count", latency.count() },
+                    { "errors", series.errors.load(std::memory_order_relaxed) },
+                    { "p50_ms", latency.quantile(0.5) },
+                    { "p95_ms", latency.quantile(0.95) },
+                    { "p99_ms", latency.quantile(0.99) },
+                    { "max_ms", latency.max() }
+                };
+            }
+            return ans;
+        };
+        return {
+            { "uptime", uptime() },
+            { "rejected", rejected.load(std::memory_order_relaxed) },
+            { "malformed", malformed.load(std::memory_order_relaxed) },
+            { "commands", dump(mCommands) },
+            { "watchdog", dump(mPhases) }
+        };
+    }
+
+    Metrics& metrics() {
+        static Metrics instance;
+        return instance;
+    }
+
+    Stopwatch::Stopwatch(Series* series) noexcept :
+        mSeries(series), mStart(std::chrono::steady_clock::now())
+    {}
+
+    void Stopwatch::success() noexcept {
+        mSuccess = true;
+    }
+
+    Stopwatch::~Stopwatch() noexcept {
+        if (!mSeries)
+            return;
+        mSeries->latency.record(std::chrono::steady_clock::now() - mStart);
+        if (!mSuccess)
+            mSeries->errors.fetch_add(1, std::memory_order_relaxed);
+    }
+}
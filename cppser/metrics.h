@@ -0,0 +1,94 @@
+#ifndef SPIRIT_METRICS_H
+#define SPIRIT_METRICS_H
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <nlohmann/json.hpp>
+
+namespace Spirit {
+    // A latency histogram that can be recorded into from any thread without locks.
+    // The buckets are spaced logarithmically, four per power of two microseconds,
+    // so a quantile is within about 20% of the real value.
+    class Histogram {
+    public:
+        void record(std::chrono::steady_clock::duration elapsed) noexcept;
+
+        std::uint64_t count() const noexcept;
+
+        // Estimates the q quantile (0 < q <= 1) in milliseconds, 0 if nothing was recorded.
+        double quantile(double q) const noexcept;
+
+        // The longest latency recorded, in milliseconds.
+        double max() const noexcept;
+    private:
+        // Enough for latencies of a few days.
+        static constexpr std::size_t bucket_count = 4 * 40;
+        std::array<std::atomic<std::uint64_t>, bucket_count> mBuckets{};
+        std::atomic<std::uint64_t> mCount{ 0 };
+        std::atomic<std::uint64_t> mMaxUs{ 0 };
+    };
+
+    // How one command or watchdog phase has been doing.
+    struct Series {
+        Histogram latency;
+        std::atomic<std::uint64_t> errors{ 0 };
+    };
+
+    // The counters of the whole process. The set of series is fixed when it is
+    // constructed, so recording never takes a lock.
+    class Metrics {
+    public:
+        Metrics();
+
+        Metrics(const Metrics&) = delete;
+        Metrics& operator = (const Metrics&) = delete;
+
+        // The series of a client command, or nullptr for unknown commands.
+        Series* command(std::string_view name) noexcept;
+
+        // The series of a watchdog phase, or nullptr if there's no such phase.
+        Series* phase(std::string_view name) noexcept;
+
+        // Requests turned down because too many were pending.
+        std::atomic<std::uint64_t> rejected{ 0 };
+        // Requests that weren't JSON or had no known command.
+        std::atomic<std::uint64_t> malformed{ 0 };
+
+        // Seconds since this was constructed.
+        std::int64_t uptime() const noexcept;
+
+        // Uptime, the counters and count, errors, p50, p95, p99 and max of every series.
+        nlohmann::json to_json() const;
+    private:
+        const std::chrono::steady_clock::time_point mStart;
+        std::map<std::string, Series, std::less<>> mCommands, mPhases;
+    };
+
+    // The metrics of this process, constructed on first use.
+    Metrics& metrics();
+
+    // Records the time from construction to destruction into a series.
+    // It counts as an error unless success() was called, so exceptions are errors.
+    class Stopwatch {
+    public:
+        // series may be nullptr, then nothing is recorded.
+        explicit Stopwatch(Series* series) noexcept;
+
+        Stopwatch(const Stopwatch&) = delete;
+        Stopwatch& operator = (const Stopwatch&) = delete;
+
+        void success() noexcept;
+
+        ~Stopwatch() noexcept;
+    private:
+        Series* mSeries;
+        const std::chrono::steady_clock::time_point mStart;
+        bool mSuccess = false;
+    };
+}
+
+#endif
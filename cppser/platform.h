@@ -0,0 +1,22 @@
+#ifndef SPIRIT_PLATFORM_H
+#define SPIRIT_PLATFORM_H
+#include <string_view>
+
+// Spirit: The few calls that differ between the Windows server and a Linux box.
+// platform_win.cpp or platform_posix.cpp is compiled, depending on the target.
+namespace Spirit {
+    // Hides the console window, to conceal our program.
+    // Errors are ignored. Does nothing on Linux, where the daemon runs headless.
+    void hide_window() noexcept;
+
+    // Displays an error message. On Linux it is written to stderr.
+    void error_dialog(std::string_view caption, std::string_view text);
+
+    // Kills the lock mouse "utility" and waits for the kill to finish.
+    // There is no such thing on Linux.
+    void kill_lock_mouse();
+
+    // The last error code of the system, GetLastError() or errno.
+    long last_error() noexcept;
+}
+#endif
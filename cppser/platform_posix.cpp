@@ -0,0 +1,17 @@
+#include "platform.h"
+#include <cerrno>
+#include <iostream>
+
+namespace Spirit {
+    void hide_window() noexcept {}
+
+    void error_dialog(std::string_view caption, std::string_view text) {
+        std::cerr << caption << ": " << text << std::endl;
+    }
+
+    void kill_lock_mouse() {}
+
+    long last_error() noexcept {
+        return errno;
+    }
+}
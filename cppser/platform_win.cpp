@@ -0,0 +1,36 @@
+#include "platform.h"
+#include <string>
+#include <windows.h>
+
+namespace Spirit {
+    void hide_window() noexcept {
+        ::ShowWindow(::GetConsoleWindow(), SW_HIDE);
+    }
+
+    void error_dialog(std::string_view caption, std::string_view text) {
+        // MessageBox wants null-terminated strings.
+        ::MessageBox(NULL, std::string(text).c_str(), std::string(caption).c_str(), MB_ICONERROR);
+    }
+
+    void kill_lock_mouse() {
+        std::string cmd = "taskkill.exe /f /im LockMouse.exe";
+        STARTUPINFO start;
+        ::ZeroMemory(&start, sizeof(start));
+        start.cb = sizeof(STARTUPINFO);
+        PROCESS_INFORMATION proc_info;
+        ::ZeroMemory(&proc_info, sizeof(proc_info));
+        ::CreateProcessA(
+            NULL, cmd.data(), NULL, NULL, TRUE,
+            CREATE_NO_WINDOW, NULL, NULL, &start, &proc_info
+        );
+        // Wait until child process exits.
+        ::WaitForSingleObject(proc_info.hProcess, INFINITE);
+        // Close process and thread handles. 
+        ::CloseHandle(proc_info.hProcess);
+        ::CloseHandle(proc_info.hThread);
+    }
+
+    long last_error() noexcept {
+        return ::GetLastError();
+    }
+}
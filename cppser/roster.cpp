@@ -0,0 +1,45 @@
+#include "roster.h"
+#include <algorithm>
+
+namespace Spirit {
+    RosterIndex::RosterIndex(const std::vector<StudentStatus>& upstream) {
+        mById.reserve(upstream.size());
+        mByName.reserve(upstream.size());
+        // Of the statuses sharing a key, keep an invalid one.
+        auto add = [](auto& index, std::string_view key, const StudentStatus* stu) {
+            const auto [it, inserted] = index.emplace(key, stu);
+            if (!inserted && stu->invalid && !it->second->invalid)
+                it->second = stu;
+        };
+        for (auto&& stu : upstream) {
+            if (!stu.id.empty())
+                add(mById, stu.id, &stu);
+            add(mByName, stu.name, &stu);
+        }
+    }
+
+    const StudentStatus* RosterIndex::find(const Student& stu) const noexcept {
+        if (!stu.id.empty()) {
+            if (auto it = mById.find(stu.id); it != mById.end())
+                return it->second;
+        }
+        const auto it = mByName.find(stu.name);
+        if (it == mByName.end())
+            return nullptr;
+        // Two students with the same name, the IDs tell them apart.
+        if (!stu.id.empty() && !it->second->id.empty() && it->second->id != stu.id)
+            return nullptr;
+        return it->second;
+    }
+
+    std::vector<Student> exclude_invalid(std::vector<Student> absent,
+        const std::vector<StudentStatus>& upstream
+    ) {
+        const RosterIndex index(upstream);
+        absent.erase(std::remove_if(absent.begin(), absent.end(), [&index](const Student& stu) {
+            const auto status = index.find(stu);
+            return status && status->invalid;
+        }), absent.end());
+        return absent;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef SPIRIT_ROSTER_H
+#define SPIRIT_ROSTER_H
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "dbman.h"
+
+// Spirit: Matching our students against what the school server says about them.
+namespace Spirit {
+    // What the school server says about a student.
+    struct StudentStatus {
+        // UTF-8 encoded, as StudentName in the response
+        std::string name;
+        // StudentID in the response, empty if the server didn't send it.
+        std::string id;
+        // True if the student doesn't need to sign in (on leave, etc.)
+        bool invalid = false;
+    };
+
+    // A hash index over the upstream statuses, so that a roster of n students can be
+    // matched in O(n) instead of comparing every pair of names.
+    // A student is matched by ID when both sides have one, otherwise by name.
+    // The index refers to the elements of upstream, which must outlive it unchanged.
+    class RosterIndex {
+    public:
+        explicit RosterIndex(const std::vector<StudentStatus>& upstream);
+
+        // Returns the status of stu, nullptr if the server didn't mention them.
+        // If several statuses share a key, an invalid one wins. The old linear scan also
+        // excluded a student when any status with their name was invalid.
+        const StudentStatus* find(const Student& stu) const noexcept;
+
+    private:
+        std::unordered_map<std::string_view, const StudentStatus*> mById, mByName;
+    };
+
+    // Returns the students in absent who are not invalid according to upstream,
+    // keeping their order. These are the ones who need a card.
+    std::vector<Student> exclude_invalid(std::vector<Student> absent,
+        const std::vector<StudentStatus>& upstream);
+}
+#endif
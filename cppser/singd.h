@@ -2,12 +2,77 @@
 #define SPIRIT_SINGD_H
 #include <thread>
 #include <memory>
+#include <mutex>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include "dbman.h"
+#include "dbservice.h"
 #include "logger.h"
+#include "metrics.h"
+#include "roster.h"
 
 // Spirit: The two daemon classes.
 namespace Spirit {
+    // A long-lived HTTP/1.1 client for the school server. The connection is kept alive
+    // between requests and the resolved endpoints are remembered. All the I/O runs on the
+    // client's own thread, and a request that takes too long is cancelled by a timer,
+    // so timeouts don't leave threads or sockets behind.
+    class HttpClient {
+    public:
+        // Starts the I/O thread.
+        HttpClient();
+
+        // Stops the I/O thread.
+        virtual ~HttpClient() noexcept;
+
+        // The I/O thread refers to the internals.
+        HttpClient(const HttpClient&) = delete;
+        HttpClient& operator = (const HttpClient&) = delete;
+
+        // POSTs the JSON body to target at host (port 80) and returns the response body.
+        // Only one request is sent at a time, others wait for their turn.
+        // Throws NetworkError on network errors, bad status codes, or if there's
+        // no response within timeout.
+        std::string post(const std::string& host, const std::string& target,
+            const std::string& body, std::chrono::milliseconds timeout);
+    private:
+        struct Impl;
+        // One request and its response.
+        struct Exchange;
+        std::unique_ptr<Impl> mImpl;
+    };
+
+    // The control channel to GS on gs_port. One UDP socket and one I/O thread serve
+    // all the commands for the lifetime of the object. Commands are sent one at a time,
+    // so each reply belongs to the command in flight. After a timeout the socket is
+    // replaced, so a late reply can't be mistaken for the next command's.
+    class GSClient {
+    public:
+        // Reads gs_port and gs_timeout (milliseconds, 2000 if not configured)
+        // from config, and starts the I/O thread.
+        explicit GSClient(const Configuration& config);
+
+        // Stops the I/O thread.
+        virtual ~GSClient() noexcept;
+
+        // The I/O thread refers to the internals.
+        GSClient(const GSClient&) = delete;
+        GSClient& operator = (const GSClient&) = delete;
+
+        // Sends msg to GS and waits for the reply. Other callers wait for their turn.
+        // Exception: NetworkError if errors related to socket occurs, for example if GS
+        // isn't up to receive our command, or if it doesn't reply within gs_timeout.
+        // GSError if the GS program says that the command has some problems with it.
+        // The what string of GSError will be exactly what it returned in the socket.
+        void send(const std::string& msg, Logfile& log);
+    private:
+        struct Impl;
+        // One command and its reply.
+        struct Command;
+        std::unique_ptr<Impl> mImpl;
+    };
+
     // Functionality from watchdog.pyw
     // To avoid data races, we prohibit setting watchdog config if there are lessons
     // that are about to end.
@@ -15,7 +80,9 @@ namespace Spirit {
     public:
         // config provides observer access to the config file.
         // The owner should be the main thread.
-        Watchdog(const Spirit::Configuration& config);
+        // All database access goes through db, and commands to GS through gs.
+        // Both must outlive this.
+        Watchdog(const Spirit::Configuration& config, DBService& db, GSClient& gs);
 
         // Disable copying
         Watchdog(const Watchdog&) = delete;
@@ -47,29 +114,50 @@ namespace Spirit {
         std::atomic_bool mPauseToken{ false };
         // Shared access to the config.
         const Spirit::Configuration& mConfig;
+        // Shared access to the database.
+        DBService& mDB;
+        // Shared access to GS.
+        GSClient& mGS;
+        // Today's lessons. Only touched by jobs running in mDB.
+        DaySchedule mSchedule;
+        // Used for stu_new.
+        HttpClient mHttp;
+        // Used to wake the worker up when one of the tokens changes.
+        std::mutex mMutex;
+        std::condition_variable mCond;
 
         // The worker thread. The necessary data is passed in through *this.
+        // It sleeps until the next lesson is due, looking at the schedule again
+        // every watchdog_poll seconds in case GS has changed it.
         void worker();
 
+        // Wakes the worker up after a token has been changed.
+        void wake() noexcept;
+
+        // Sleeps for duration, but returns at once if a stop is requested or
+        // the pause token no longer equals paused.
+        void sleep(std::chrono::seconds duration, bool paused = false);
+
         // Automatically checks whoever is absent, gets the leave info
         // and writes those who are absent and at school to database.
         // However, this does not check whether the lesson has been processed.
         // This method tries to simulate a real sign in by getting the latest info.
         // However, this makes it less robust if the server is down. 
         // Exceptions: NetworkError, logic_error, nlohmann::json::parse_error.
-        void simul_sign(Connection& localdata, const LessonInfo& lesson, Logfile& logfile);
+        void simul_sign(const LessonInfo& lesson, Logfile& logfile);
 
         // In case of network failures mentioned above, we can also deduce who needs help
         // from the database. Although this piece of info is less up to date, it doesn't
         // require the network or the upstream server.
-        void local_sign(Connection& localdata, const LessonInfo& lesson, Logfile& logfile);
+        void local_sign(const LessonInfo& lesson, Logfile& logfile);
     };
 
     // Impl of the singin server, from dbman.pyw
     class Singer {
     public:
-        // Initializes this with a shared configuration file and the lock.
-        Singer(const Spirit::Configuration& config);
+        // Initializes this with a shared configuration file, the database service
+        // and the GS client.
+        Singer(const Spirit::Configuration& config, DBService& db, GSClient& gs);
 
         // Disable copying
         Singer(const Singer&) = delete;
@@ -82,18 +170,31 @@ namespace Spirit {
         // As in the design, this daemon will occupy the "main thread", so
         // its function is called mainloop. Returns after receiving a quit
         // command
+        // The socket is driven asynchronously, and the handlers run on a pool of
+        // "workers" threads (4 if not configured), at most "max_pending" (64) at a time.
+        // Database work is handed to the DBService.
         void mainloop(Watchdog& watchdog, Logfile& logfile);
     private:
         // Ref to the configuration var.
         const Spirit::Configuration& mConfig;
 
-        // A unique pointer to the local database. This is valid only after mainloop
-        // has been called.
-        std::unique_ptr<Connection> mLocalData;
+        // Shared access to the database.
+        DBService& mDB;
+
+        // Shared access to GS.
+        GSClient& mGS;
+
+        // Today's lessons, so that mapping sessid to a lesson doesn't query the db.
+        // Only touched by jobs running in mDB.
+        DaySchedule mSchedule;
+
+        // Calls the handler for request's command and returns its result.
+        nlohmann::json dispatch(const nlohmann::json& request, Logfile& log, Watchdog& watchdog) noexcept;
 
         // Many handlers for the various commands.
         // They should take a json&, a logfile& and return another json as result.
         // For the structure of the request and responses, see dbserv/dbman.pyw.
+        // They may run concurrently.
         
         // sessid starts from 0
         nlohmann::json handle_rep_abs(const nlohmann::json& request, Logfile& log) noexcept;
@@ -107,12 +208,29 @@ namespace Spirit {
         nlohmann::json handle_notice(const nlohmann::json& request, Logfile& log) noexcept;
         
         nlohmann::json handle_doggie(const nlohmann::json& request, Logfile& log, Watchdog& watchdog) noexcept;
+
+        // Latency histograms and counters of the commands, the watchdog and the database.
+        nlohmann::json handle_stats(const nlohmann::json& request, Logfile& log) noexcept;
+
+        // Runs the database commands in request["requests"] in order, as one job on one
+        // transaction with one schedule lookup. Returns their results in "results".
+        nlohmann::json handle_batch(const nlohmann::json& request, Logfile& log) noexcept;
     };
 
     // Pull out the helper functions to facilitate testing.
     // Returns the list of lessons that will end DK in less than sec seconds.
     std::vector<LessonInfo> near_exits(Connection& conn, int sec);
 
+    // Returns the first lesson in timeline (sorted by endtime) that ends after both now
+    // and last_proc, the endtime of the last lesson processed. nullptr if there is none.
+    const LessonInfo* next_lesson(const std::vector<LessonInfo>& timeline, int now, int last_proc) noexcept;
+
+    // Splits response into datagrams of at most mtu bytes (clamped to 512..65507), spreading
+    // its "name" array over them and numbering them with "seq" out of "count".
+    // A response that fits, or has no names to spread, is returned whole without numbers.
+    // A single name longer than a datagram gets one of its own, which may exceed mtu.
+    std::vector<std::string> split_response(const nlohmann::json& response, std::size_t mtu);
+
     // Error class for network errors
     struct NetworkError : public std::runtime_error {
         using std::runtime_error::runtime_error;
@@ -127,40 +245,34 @@ namespace Spirit {
     // Throws logic_error if the URL is empty or doesn't contain a host name like 127.0.0.1
     void parse_url(const Configuration& config, std::string& host, std::string& url);
 
-    // Executes the request to leave_info and returns the result body.
-    // Throws std::runtime_error on any error.
-    // This is a very lengthy operation, so you **must** use a future/promise mechanism to invoke it
-    // in order to achieve reasonable timeout functionality (std::async wouldn't work because the future's
-    // dtor waits in that case)
-    // Because when this is executing in a different thread, the parent should be waiting,
-    // we dare pass log files around.
-    nlohmann::json execute_request(
-        const Configuration& config,
-        const std::vector<Student>& absent,
-        const LessonInfo& lesson,
-        Logfile& logfile
-    );
+    // Reads log_level, log_format, log_limits and the log_rotate_* entries from the config.
+    // If base is given, the file rotates over the keep_logs files of select_logfile(base, ...).
+    // Throws std::invalid_argument on unknown levels or formats, or if log_compress
+    // is asked for without SPIRIT_LOG_GZIP, and nlohmann::json::type_error if the entries
+    // have the wrong types.
+    LogOptions log_options(const Configuration& config, const std::string& base = "");
+
+    // Extracts result.students[*] from a stu_new response body with a SAX parser.
+    // Everything else, face data included, is skipped without building a DOM.
+    // Throws nlohmann::json::parse_error if body is not valid JSON, NetworkError
+    // if it contains something we can't represent.
+    std::vector<StudentStatus> parse_stu_new(std::string_view body);
 
-    // A wrapper around execute request which handles the timeouts.
+    // Asks the school server (url_stu_new in the config) for the latest status of
+    // the students in lesson, using client.
     // Timeout is retrieved from the config.
     // If the result is retrieved within time, returns the result.
     // Throws NetworkError on network related errors or time out.
     // logic_error if the URL in the config cannot be interpreted.
     // nlohmann::json::parse_error if the response from the server
     // cannot be parsed as JSON.
-    nlohmann::json get_stu_new(
+    std::vector<StudentStatus> get_stu_new(
+        HttpClient& client,
         const Configuration& config,
         const std::vector<Student>& absent,
         const LessonInfo& lesson,
         Logfile& logfile
     );
-
-    // This function sends a message to the GS port.
-    // Exception: NetworkError if errors related to socket occurs. For example, if GS
-    // isn't up to receive our command.
-    // GSError if the GS program says that the command has some problems with it.
-    // The what string of GSError will be exactly what it returned in the socket.
-    void send_to_gs(const Configuration& config, Logfile& log, const std::string& msg);
 }
 
 #endif
\ No newline at end of file
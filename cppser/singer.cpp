@@ -1,113 +1,277 @@
 // Implementation for Singer class's mainloop()
 #include <boost/asio.hpp>
 #include "singd.h"
+#include <algorithm>
 #include <cstdlib>
+#include <functional>
+#include <iterator>
+#include <vector>
 
 namespace Spirit {
     using nlohmann::json;
 
-    Singer::Singer(const Spirit::Configuration& config) :
-        mConfig(config)
+    namespace {
+        // The command of request, or an empty string if it has none.
+        std::string command_of(const json& request) {
+            const auto iter = request.find("command");
+            return iter != request.end() && iter->is_string() ? iter->get<std::string>() : "";
+        }
+
+        const LessonInfo& lesson_at(const std::vector<LessonInfo>& lessons, int sessid) {
+            if (sessid < 0 || sessid >= static_cast<int>(lessons.size()))
+                throw std::out_of_range("sessid out of range");
+            return lessons[sessid];
+        }
+
+        // The response to today_info.
+        json today_json(const json& request, const std::string& machine_id,
+            const std::vector<LessonInfo>& lessons
+        ) {
+            json ans;
+            ans["success"] = false;
+            if (request.at("machine") != machine_id) {
+                ans["what"] = "Wrong machine";
+                ans["machine"] = machine_id;
+                return ans;
+            }
+            ans["end"] = json::array();
+            for (auto&& lesson : lessons)
+                ans["end"].push_back(Clock::time2str(lesson.endtime));
+            ans["success"] = true;
+            return ans;
+        }
+
+        // The response to report_absent. If the request asks for a page with cursor, offset
+        // or limit, the students are ordered by ID, the page starts offset students after the
+        // one with ID cursor, and next_cursor is where the next page starts. Students who
+        // sign in between two pages don't shift the others.
+        json absent_json(const json& request, const std::vector<Student>& students) {
+            json ans;
+            ans["success"] = true;
+            ans["name"] = json::array();
+            if (!request.contains("cursor") && !request.contains("offset") && !request.contains("limit")) {
+                for (auto&& [name, id] : students)
+                    ans["name"].push_back(name);
+                return ans;
+            }
+            const std::string cursor = request.value("cursor", "");
+            const int offset = request.value("offset", 0), limit = request.value("limit", 0);
+            if (offset < 0 || limit < 0)
+                throw std::out_of_range("offset and limit should not be negative");
+            std::vector<const Student*> sorted;
+            sorted.reserve(students.size());
+            for (auto&& stu : students)
+                sorted.push_back(&stu);
+            std::sort(sorted.begin(), sorted.end(), [](const Student* lhs, const Student* rhs) {
+                return lhs->id < rhs->id;
+            });
+            auto first = sorted.begin();
+            if (!cursor.empty())
+                first = std::upper_bound(sorted.begin(), sorted.end(), cursor,
+                    [](const std::string& id, const Student* stu) { return id < stu->id; });
+            first += std::min<std::ptrdiff_t>(offset, sorted.end() - first);
+            const auto last = limit ? first + std::min<std::ptrdiff_t>(limit, sorted.end() - first) : sorted.end();
+            for (auto iter = first; iter != last; ++iter)
+                ans["name"].push_back((*iter)->name);
+            ans["total"] = students.size();
+            if (last != sorted.end() && last != first)
+                ans["next_cursor"] = (*std::prev(last))->id;
+            return ans;
+        }
+
+        // Runs one request of a batch in the DB thread. Only the database commands can be
+        // batched, the others would wait for the DB thread themselves.
+        json run_batched(Connection& conn, const std::vector<LessonInfo>& lessons,
+            const json& request
+        ) noexcept {
+            json ans;
+            ans["success"] = false;
+            try {
+                const auto command = command_of(request);
+                if (command == "today_info")
+                    return today_json(request, get_machine(conn), lessons);
+                if (command == "report_absent")
+                    return absent_json(request, report_absent(conn, lesson_at(lessons, request.at("sessid")).id));
+                if (command == "write_record") {
+                    IncrementalClock clock;
+                    write_record(conn, lesson_at(lessons, request.at("sessid")).id,
+                        request.at("name").get<std::vector<std::string>>(), clock);
+                    ans["success"] = true;
+                    return ans;
+                }
+                ans["what"] = command.empty() ? "Missing command!" : "Can't be batched!";
+            } catch (const std::out_of_range& ex) {
+                ans["what"] = "out_of_range: "s + ex.what();
+            } catch (const SQLError& ex) {
+                ans["what"] = "SQL error: "s + ex.what();
+            } catch (const std::exception& ex) {
+                ans["what"] = ex.what();
+            }
+            return ans;
+        }
+    }
+
+    Singer::Singer(const Spirit::Configuration& config, DBService& db, GSClient& gs) :
+        mConfig(config), mDB(db), mGS(gs)
     {}
 
     void Singer::mainloop(Watchdog& watchdog, Logfile& logfile) {
         namespace asio = boost::asio;
         using asio::ip::udp;
         // If intro or serv_port are missing, no need to go on.
-        logfile << mConfig["intro"].get<std::string>() << '\n';
+        SPIRIT_LOG(logfile, info, "singer") << mConfig["intro"].get<std::string>() << '\n';
         asio::io_context ioc;
         udp::socket serv_sock(ioc, udp::endpoint(udp::v4(), mConfig["serv_port"]));
-        logfile << "Created socket, bound to " << mConfig["serv_port"] << '\n';
-        mLocalData.reset(new Connection(mConfig["dbname"], mConfig["passwd"]));
-        logfile << "Opened local data, singer's instance\n";
+        SPIRIT_LOG(logfile, info, "singer") << "Created socket, bound to " << mConfig["serv_port"] << '\n';
         logfile.flush();
-        while (true) {
-            udp::endpoint client;
-            // Get the request
-            nlohmann::json request;
-            // The result to be returned
-            nlohmann::json result;
-            // Make sure to flush logs
-            LogSection log_section(logfile);
-            // True if should be dispatched
-            bool dispatch = true;
+        // The socket is only touched by the thread running ioc. The handlers run on the pool,
+        // so that a slow command doesn't hold up the others.
+        asio::thread_pool pool(mConfig.value("workers", 4));
+        // Requests being handled. Beyond max_pending, new requests are turned down.
+        const int max_pending = mConfig.value("max_pending", 64);
+        std::atomic_int pending{ 0 };
+        // Large enough for any datagram, so that no request is cut.
+        std::vector<char> req_buf(65536);
+        udp::endpoint client;
+
+        // Sends a datagram to dest. Can be called from any thread.
+        auto send = [&](const udp::endpoint& dest, std::shared_ptr<std::string> dumped) {
+            asio::post(ioc, [&serv_sock, &logfile, dest, dumped]{
+                serv_sock.async_send_to(asio::buffer(*dumped), dest,
+                    [&logfile, dumped](const boost::system::error_code& ec, std::size_t) {
+                        if (ec)
+                            SPIRIT_LOG(logfile, warn, "singer") << "When sending response to client: " << ec.message() << std::endl;
+                    });
+            });
+        };
+
+        // Sends result to dest, split to fit in mtu bytes if the request asked for that.
+        auto reply = [&](const udp::endpoint& dest, const json& result, const json& request = {}) {
+            const auto mtu = request.find("mtu");
+            if (mtu == request.end() || !mtu->is_number_unsigned()) {
+                auto dumped = std::make_shared<std::string>(result.dump());
+                SPIRIT_LOG(logfile, debug, "response") << "Generated response: " << *dumped << std::endl;
+                return send(dest, std::move(dumped));
+            }
+            auto parts = split_response(result, mtu->get<std::size_t>());
+            SPIRIT_LOG(logfile, debug, "response") << "Generated response in " << parts.size()
+                << " datagrams: " << result.dump() << std::endl;
+            for (auto& part : parts)
+                send(dest, std::make_shared<std::string>(std::move(part)));
+        };
+
+        // Handles one datagram. Returns false if we should stop.
+        auto on_request = [&](std::string_view data, const udp::endpoint& from) {
+            json request;
             try {
-                asio::streambuf req_buf;
-                req_buf.commit(serv_sock.receive_from(req_buf.prepare(1024), client));
-                std::istream rfile(&req_buf);
-                rfile >> request;
-                logfile << client << ": " << request.dump() << std::endl;
-            } catch (const boost::system::system_error& ex) {
-                logfile << ex.what() << std::endl;
-                continue;
-            } catch (nlohmann::json::parse_error& ex) {
-                logfile << ex.what() << std::endl;
-                result["success"] = false;
-                result["what"] = "Unrecognized format, "s + ex.what();
-                dispatch = false;
+                request = json::parse(data.begin(), data.end());
+                SPIRIT_LOG(logfile, info, "request") << from << ": " << request.dump() << std::endl;
+            } catch (const json::parse_error& ex) {
+                ++metrics().malformed;
+                SPIRIT_LOG(logfile, warn, "request") << ex.what() << std::endl;
+                reply(from, {{ "success", false }, { "what", "Unrecognized format, "s + ex.what() }});
+                return true;
             }
-            if (dispatch) {
-                if (!request.contains("command")) {
-                    result["success"] = false;
-                    result["what"] = "Missing command!";
-                } else {
-                    const std::string command = request["command"];
-                    if (command == "report_absent")
-                        result = handle_rep_abs(request, logfile);
-                    else if (command == "write_record")
-                        result = handle_wrt_rec(request, logfile);
-                    else if (command == "restart_gs")
-                        result = handle_restart(request, logfile);
-                    else if (command == "today_info")
-                        result = handle_today(request, logfile);
-                    else if (command == "quit_spirit") {
-                        logfile << "Stopping on request from client!\n";
-                        result["success"] = true;
-                        serv_sock.send_to(boost::asio::buffer(result.dump()), client);
-                        return;
-                    } else if (command == "flush_notice")
-                        result = handle_notice(request, logfile);
-                    else if (command == "doggie_stick")
-                        result = handle_doggie(request, logfile, watchdog);
-                    else {
-                        result["success"] = false;
-                        result["what"] = "Unknown command!";
-                    }
-                }
+            if (request.contains("command") && request["command"] == "quit_spirit") {
+                SPIRIT_LOG(logfile, info, "singer") << "Stopping on request from client!\n";
+                boost::system::error_code ec;
+                serv_sock.send_to(asio::buffer(json({{ "success", true }}).dump()), from, 0, ec);
+                return false;
             }
-            auto result_dumped = result.dump();
-            logfile << "Generated response: " << result_dumped << std::endl;
-            try {
-                serv_sock.send_to(boost::asio::buffer(result_dumped), client);
-            } catch (const boost::system::system_error& ex) {
-                logfile << "When sending response to client: " << ex.what() << std::endl;
+            if (pending >= max_pending) {
+                ++metrics().rejected;
+                reply(from, {{ "success", false }, { "what", "Server busy, try again later." }});
+                return true;
             }
+            ++pending;
+            asio::post(pool, [&, request = std::move(request), from]{
+                reply(from, dispatch(request, logfile, watchdog), request);
+                --pending;
+            });
+            return true;
+        };
+
+        std::function<void()> receive = [&]{
+            serv_sock.async_receive_from(asio::buffer(req_buf), client,
+                [&](const boost::system::error_code& ec, std::size_t n) {
+                    // Make sure to flush logs
+                    LogSection log_section(logfile);
+                    if (ec)
+                        SPIRIT_LOG(logfile, warn, "singer") << ec.message() << std::endl;
+                    else if (!on_request(std::string_view(req_buf.data(), n), client)) {
+                        ioc.stop();
+                        return;
+                    }
+                    receive();
+                });
+        };
+        receive();
+        ioc.run();
+        // Let the handlers in flight finish, their replies are dropped.
+        pool.join();
+    }
+
+    json Singer::dispatch(const json& request, Logfile& log, Watchdog& watchdog) noexcept {
+        json result;
+        result["success"] = false;
+        const auto iter = request.find("command");
+        if (iter == request.end() || !iter->is_string()) {
+            ++metrics().malformed;
+            result["what"] = "Missing command!";
+            return result;
         }
+        const auto& command = iter->get_ref<const std::string&>();
+        Series* const series = metrics().command(command);
+        if (!series) {
+            ++metrics().malformed;
+            result["what"] = "Unknown command!";
+            return result;
+        }
+        Stopwatch watch(series);
+        if (command == "report_absent")
+            result = handle_rep_abs(request, log);
+        else if (command == "write_record")
+            result = handle_wrt_rec(request, log);
+        else if (command == "restart_gs")
+            result = handle_restart(request, log);
+        else if (command == "today_info")
+            result = handle_today(request, log);
+        else if (command == "flush_notice")
+            result = handle_notice(request, log);
+        else if (command == "doggie_stick")
+            result = handle_doggie(request, log, watchdog);
+        else if (command == "stats")
+            result = handle_stats(request, log);
+        else if (command == "batch")
+            result = handle_batch(request, log);
+        if (result.value("success", false))
+            watch.success();
+        return result;
     }
 
     json Singer::handle_rep_abs(const json& request, Logfile& log) noexcept {
         json ans;
         try {
-            const auto lessons = get_lesson(*mLocalData);
             ans["success"] = false;
             if (!request.contains("sessid")) {
                 ans["what"] = "No sessid specified!";
                 return ans;
             }
             const int sessid = request["sessid"];
-            if (sessid < 0 || sessid >= static_cast<int>(lessons.size())) {
-                ans["what"] = "sessid out of range";
-                return ans;
-            }
-            ans["success"] = true;
-            ans["name"] = json::array();
-                for (auto&& [name, id] : report_absent(*mLocalData, lessons[sessid].id))
-                    ans["name"].push_back(std::move(name));
+            // Clients asking for the same lesson at the same time share one query.
+            auto absent = mDB.submit_read("report_absent " + std::to_string(sessid),
+                [this, sessid](Connection& conn) {
+                    return report_absent(conn, lesson_at(mSchedule.lessons(conn), sessid).id);
+                });
+            ans = absent_json(request, absent.get());
+        } catch (const std::out_of_range& ex) {
+            ans["success"] = false;
+            ans["what"] = ex.what();
         } catch (const SQLError& ex) {
             ans["success"] = false;
             ans["what"] = ex.what();
         } catch (const std::exception& ex) {
-            log << "Unexpected exception in handle_rep_abs()\n";
+            SPIRIT_LOG(log, error, "singer") << "Unexpected exception in handle_rep_abs()\n";
             ans["what"] = ex.what();
             ans["success"] = false;
         }
@@ -118,13 +282,12 @@ namespace Spirit {
         json ans;
         ans["success"] = false;
         try {
-            const auto lessons = get_lesson(*mLocalData);
             const int sessid = request.at("sessid");
-            if (sessid < 0 || sessid >= lessons.size())
-                throw std::out_of_range("sessid out of range!");
             std::vector<std::string> req_names(request.at("name").begin(), request.at("name").end());
-            IncrementalClock clock;
-            write_record(*mLocalData, lessons[sessid].id, std::move(req_names), clock);
+            mDB.submit([this, sessid, names = std::move(req_names)](Connection& conn) mutable {
+                IncrementalClock clock;
+                write_record(conn, lesson_at(mSchedule.lessons(conn), sessid).id, std::move(names), clock);
+            }).get();
             ans["success"] = true;
         } catch (const std::out_of_range& ex) {
             ans["what"] = "out_of_range: "s + ex.what();
@@ -140,24 +303,17 @@ namespace Spirit {
         json ans;
         ans["success"] = false;
         try {
-            auto machine_id = get_machine(*mLocalData);
-            if (request.at("machine") != machine_id) {
-                ans["what"] = "Wrong machine";
-                ans["machine"] = std::move(machine_id);
-                return ans;
-            }
-            // Matched here
-            auto lessons = get_lesson(*mLocalData);
-            ans["end"] = json::array();
-            for (auto&& lesson : lessons)
-                ans["end"].push_back(Clock::time2str(lesson.endtime));
-            ans["success"] = true;
+            auto today = mDB.submit_read("today_info", [this](Connection& conn) {
+                return std::make_pair(get_machine(conn), mSchedule.lessons(conn));
+            });
+            const auto& [machine_id, lessons] = today.get();
+            ans = today_json(request, machine_id, lessons);
         } catch (const std::out_of_range& ex) {
             ans["what"] = "out_of_range: "s + ex.what();
         } catch (const SQLError& ex) {
             ans["what"] = "SQL error: "s + ex.what();
         } catch (const std::exception& ex) {
-            log << "Unexpected std::exception in handle_today()\n";
+            SPIRIT_LOG(log, error, "singer") << "Unexpected std::exception in handle_today()\n";
             ans["what"] = ex.what();
         }
         return ans;
@@ -165,28 +321,28 @@ namespace Spirit {
 
     json Singer::handle_restart(const json& request, Logfile& log) noexcept {
         try {
-            send_to_gs(mConfig, log, "$DoRestart");
+            mGS.send("$DoRestart", log);
             return json({{ "success", true }});
         } catch (const NetworkError& ex) {
             return json({{ "success", false }, { "what", ex.what() }});
         } catch (const GSError&) {
             return json({{ "success", false }, { "what", "GS internal error, see logs." }});
         } catch (const std::exception& ex) {
-            log << "unexpected '" << ex.what() << "' in handle_restart()\n";
+            SPIRIT_LOG(log, error, "singer") << "unexpected '" << ex.what() << "' in handle_restart()\n";
             return json({{ "success", false }, { "what", "UKE, see logs." }});
         }
     }
 
     json Singer::handle_notice(const json& request, Logfile& log) noexcept {
         try {
-            send_to_gs(mConfig, log, "$DoMediaTask");
+            mGS.send("$DoMediaTask", log);
             return {{ "success", true }};
         } catch (const NetworkError& ex) {
             return json({{ "success", false }, { "what", ex.what() }});
         } catch (const GSError&) {
             return json({{ "success", false }, { "what", "GS internal error, see logs." }});
         } catch (const std::exception& ex) {
-            log << "Unexpected std::exception in Singer::handle_notice()\n";
+            SPIRIT_LOG(log, error, "singer") << "Unexpected std::exception in Singer::handle_notice()\n";
             return json({{ "success", false }, {"what", "Unexpected exception: "s + ex.what() }});
         }
     }
@@ -205,9 +361,123 @@ namespace Spirit {
             ans["what"] = "Missing argument: "s + ex.what();
         } catch (const std::exception& ex) {
             ans["success"] = false;
-            log << "Unknown error: " << ex.what() << '\n';
+            SPIRIT_LOG(log, error, "singer") << "Unknown error: " << ex.what() << '\n';
             ans["what"] = "Unknown error, see logs.";
         }
         return ans;
     }
+
+    json Singer::handle_stats(const json&, Logfile& log) noexcept {
+        try {
+            json ans = metrics().to_json();
+            // Read on the DB thread, which owns the connection.
+            ans["db"] = mDB.submit([](Connection& conn) {
+                const auto& busy = conn.busy_stats();
+                return json({
+                    { "steps", conn.steps() },
+                    { "cache_hits", conn.cache().hits() },
+                    { "cache_misses", conn.cache().misses() },
+                    { "busy_events", busy.events },
+                    { "busy_timeouts", busy.timeouts },
+                    { "busy_wait_ms", busy.waited.count() / 1000.0 }
+                });
+            }).get();
+            ans["success"] = true;
+            return ans;
+        } catch (const std::exception& ex) {
+            SPIRIT_LOG(log, error, "singer") << "Unexpected std::exception in handle_stats(): " << ex.what() << '\n';
+            return json({{ "success", false }, { "what", ex.what() }});
+        }
+    }
+
+    json Singer::handle_batch(const json& request, Logfile& log) noexcept {
+        json ans;
+        ans["success"] = false;
+        try {
+            const auto& requests = request.at("requests");
+            if (!requests.is_array()) {
+                ans["what"] = "requests should be an array!";
+                return ans;
+            }
+            const bool writes = std::any_of(requests.begin(), requests.end(), [](const json& sub) {
+                return command_of(sub) == "write_record";
+            });
+            // We wait for the job, so it can refer to the request.
+            // Returns the results and whether the batch was rolled back.
+            auto [results, rolled_back] = mDB.submit([this, &requests, writes](Connection& conn) {
+                // All the reads see one snapshot. If there are writes, lock up front,
+                // upgrading a deferred transaction could fail on GS's lock.
+                Transaction trans(conn, writes ? Transaction::Mode::exclusive : Transaction::Mode::deferred);
+                const auto& lessons = mSchedule.lessons(conn);
+                json results = json::array();
+                bool failed = false;
+                for (auto&& sub : requests) {
+                    // The writes are all or nothing. sqlite may even have rolled back already,
+                    // so don't run anything more.
+                    if (failed) {
+                        results.push_back({{ "success", false }, { "what", "Skipped, a write before failed" }});
+                        continue;
+                    }
+                    results.push_back(run_batched(conn, lessons, sub));
+                    failed = command_of(sub) == "write_record" && !results.back()["success"].get<bool>();
+                }
+                if (!failed) {
+                    trans.commit();
+                    return std::make_pair(std::move(results), false);
+                }
+                // trans is rolled back on return.
+                for (std::size_t i = 0; i < results.size(); i++)
+                    if (command_of(requests[i]) == "write_record" && results[i]["success"].get<bool>())
+                        results[i] = {{ "success", false }, { "what", "Rolled back, a later write failed" }};
+                return std::make_pair(std::move(results), true);
+            }).get();
+            for (std::size_t i = 0; i < results.size(); i++)
+                if (!results[i]["success"].get<bool>())
+                    SPIRIT_LOG(log, warn, "singer") << "batch request " << i << " failed: "
+                        << results[i].value("what", "") << '\n';
+            ans["results"] = std::move(results);
+            if (rolled_back)
+                ans["what"] = "A write failed, nothing in the batch was written";
+            else
+                ans["success"] = true;
+        } catch (const SQLError& ex) {
+            ans["what"] = "SQL error: "s + ex.what();
+        } catch (const std::exception& ex) {
+            ans["what"] = ex.what();
+        }
+        return ans;
+    }
+
+    std::vector<std::string> split_response(const json& response, std::size_t mtu) {
+        mtu = std::clamp<std::size_t>(mtu, 512, 65507);
+        auto dumped = response.dump();
+        const auto names = response.find("name");
+        if (dumped.size() <= mtu || names == response.end() || !names->is_array() || names->empty())
+            return { std::move(dumped) };
+        // What every datagram has besides the names, with seq and count as long as they can get.
+        json part = response;
+        part["seq"] = part["count"] = names->size();
+        part["name"] = json::array();
+        const auto overhead = part.dump().size();
+        std::vector<json> pages(1, json::array());
+        std::size_t used = overhead;
+        for (auto&& name : *names) {
+            // Plus a comma
+            const auto size = name.dump().size() + 1;
+            if (used + size > mtu && !pages.back().empty()) {
+                pages.emplace_back(json::array());
+                used = overhead;
+            }
+            pages.back().push_back(name);
+            used += size;
+        }
+        std::vector<std::string> parts;
+        part["count"] = pages.size();
+        for (std::size_t i = 0; i < pages.size(); i++) {
+            part["seq"] = i;
+            part["name"] = std::move(pages[i]);
+            parts.push_back(part.dump());
+        }
+        return parts;
+    }
 }
\ No newline at end of file
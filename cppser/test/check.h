@@ -0,0 +1,21 @@
+#ifndef SPIRIT_TEST_CHECK_H
+#define SPIRIT_TEST_CHECK_H
+#include <iostream>
+
+// The tests are plain programs run by ctest, main returns check_result().
+namespace Spirit::test {
+    inline int failures = 0;
+
+    inline int check_result() {
+        if (failures)
+            std::cerr << failures << " check(s) failed\n";
+        return failures ? 1 : 0;
+    }
+}
+
+// Reports cond if it doesn't hold and goes on with the test.
+#define CHECK(cond) \
+    ((cond) ? (void)0 : (++::Spirit::test::failures, \
+        void(std::cerr << __FILE__ << ':' << __LINE__ << ": CHECK(" #cond ") failed\n")))
+
+#endif
@@ -0,0 +1,60 @@
+// HttpResponseParser on good and malformed responses.
+#include <string>
+#include "../http_parser.h"
+#include "check.h"
+
+namespace {
+    using Spirit::HttpResponseParser;
+    using Spirit::HttpParseError;
+
+    // Parses response in one go. Returns the body, or "error" if the parser threw.
+    std::string parse(const std::string& response, std::size_t max_body = 1024) {
+        std::string body;
+        try {
+            HttpResponseParser parser([&](std::string_view part) { body.append(part); }, max_body);
+            parser.feed(response);
+            if (!parser.done())
+                parser.feed_eof();
+            return body;
+        } catch (const HttpParseError&) {
+            return "error";
+        }
+    }
+
+    std::string with_length(const std::string& length, const std::string& body = "{}") {
+        return "HTTP/1.1 200 OK\r\nContent-Length: " + length + "\r\n\r\n" + body;
+    }
+}
+
+int main() {
+    CHECK(parse(with_length("2")) == "{}");
+    CHECK(parse(with_length(" 2 ")) == "{}");
+    CHECK(parse(with_length("0", "")).empty());
+    // Content-Length must be digits only.
+    CHECK(parse(with_length("-1")) == "error");
+    CHECK(parse(with_length("+2")) == "error");
+    CHECK(parse(with_length("2abc")) == "error");
+    CHECK(parse(with_length("")) == "error");
+    CHECK(parse(with_length("0x2")) == "error");
+    // Overflow and bodies beyond the limit
+    CHECK(parse(with_length("18446744073709551616")) == "error");
+    CHECK(parse(with_length("99999999999999999999999")) == "error");
+    CHECK(parse(with_length("1025")) == "error");
+    // Chunked
+    const std::string chunked = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    CHECK(parse(chunked + "2\r\n{}\r\n0\r\n\r\n") == "{}");
+    CHECK(parse(chunked + "2;ext=1\r\n{}\r\n0\r\n\r\n") == "{}");
+    CHECK(parse(chunked + "-2\r\n{}\r\n0\r\n\r\n") == "error");
+    CHECK(parse(chunked + "2x\r\n{}\r\n0\r\n\r\n") == "error");
+    CHECK(parse(chunked + "fffffffffffffffff\r\n") == "error");
+    CHECK(parse(chunked + "401\r\n") == "error");
+    CHECK(parse(chunked + "200\r\n" + std::string(512, 'a') + "\r\n200\r\n" + std::string(512, 'a')
+        + "\r\n1\r\na\r\n0\r\n\r\n") == "error");
+    // Until EOF
+    CHECK(parse("HTTP/1.0 200 OK\r\n\r\n" + std::string(1024, 'a')).size() == 1024);
+    CHECK(parse("HTTP/1.0 200 OK\r\n\r\n" + std::string(1025, 'a')) == "error");
+    // Status line
+    CHECK(parse("HTTP/1.1 2x0 OK\r\nContent-Length: 0\r\n\r\n") == "error");
+    CHECK(parse("HTTP/1.1 -20 OK\r\nContent-Length: 0\r\n\r\n") == "error");
+    return Spirit::test::check_result();
+}
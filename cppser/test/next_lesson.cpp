@@ -0,0 +1,25 @@
+// The watchdog's choice of the next lesson to process.
+#include "../singd.h"
+#include "check.h"
+
+int main() {
+    using namespace Spirit;
+    // Two lessons ending inside simul_limit of each other.
+    const std::vector<LessonInfo> timeline = {
+        { 36000, "A", 1 },
+        { 36060, "B", 2 }
+    };
+    const int now = 35900;
+    auto next = next_lesson(timeline, now, -1);
+    CHECK(next && next->id == "A");
+    // After A, B is next. After B, A must not come back.
+    next = next_lesson(timeline, now, 36000);
+    CHECK(next && next->id == "B");
+    CHECK(next_lesson(timeline, now, 36060) == nullptr);
+    // Lessons that have ended are skipped.
+    next = next_lesson(timeline, 36030, -1);
+    CHECK(next && next->id == "B");
+    CHECK(next_lesson(timeline, 36060, -1) == nullptr);
+    CHECK(next_lesson({}, now, -1) == nullptr);
+    return test::check_result();
+}
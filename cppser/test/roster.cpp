@@ -0,0 +1,34 @@
+// Matching the roster against the statuses from the school server.
+#include "../roster.h"
+#include "check.h"
+
+namespace {
+    using namespace Spirit;
+
+    std::vector<std::string> names(const std::vector<Student>& students) {
+        std::vector<std::string> ans;
+        for (auto&& stu : students)
+            ans.push_back(stu.name);
+        return ans;
+    }
+}
+
+int main() {
+    using Names = std::vector<std::string>;
+    const std::vector<Student> absent = { { "张三", "" }, { "李四", "" } };
+    // Two statuses with the same name and no IDs: any invalid one excludes, in either order.
+    CHECK(names(exclude_invalid(absent, { { "张三", "", false }, { "张三", "", true } })) == Names{ "李四" });
+    CHECK(names(exclude_invalid(absent, { { "张三", "", true }, { "张三", "", false } })) == Names{ "李四" });
+    CHECK(names(exclude_invalid(absent, { { "张三", "", false }, { "张三", "", false } }))
+        == Names({ "张三", "李四" }));
+    // With IDs on both sides, the namesakes are told apart.
+    const std::vector<Student> with_ids = { { "张三", "1" }, { "张三", "2" } };
+    const std::vector<StudentStatus> upstream = { { "张三", "1", false }, { "张三", "2", true } };
+    const auto left = exclude_invalid(with_ids, upstream);
+    CHECK(left.size() == 1 && left[0].id == "1");
+    // Only the server knows the IDs, the name decides as before.
+    CHECK(exclude_invalid(absent, upstream).size() == 1);
+    // Unknown students stay.
+    CHECK(exclude_invalid(absent, {}).size() == 2);
+    return test::check_result();
+}
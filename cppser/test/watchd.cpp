@@ -1,16 +1,19 @@
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include "../platform.h"
 #include "../singd.h"
-#include <windows.h>
 
 int main() {
     using namespace Spirit;
-    ::ShowWindow(::GetConsoleWindow(), SW_HIDE);
+    hide_window();
     nlohmann::json config;
     std::ifstream config_file("man.json", std::ios::in);
     config_file >> config;
-    Watchdog watchdog(config);
+    DBService db(config);
+    GSClient gs(config);
+    Watchdog watchdog(config, db, gs);
     watchdog.start();
-    std::system("pause");
+    std::cout << "Press Enter to stop the watchdog." << std::endl;
+    std::cin.get();
 }
\ No newline at end of file
@@ -0,0 +1,79 @@
+// Writes a synthetic attendance database for benchmarks and load tests.
+// Usage: spirit_gendb <file> [--passwd key] [--days n] [--lessons n] [--students n]
+//     [--classes n] [--absent ratio] [--excluded ratio] [--spacing sec] [--seed n]
+//     [--machine id] [--force]
+// Without --passwd the file is a plain sqlite database, otherwise it is encrypted
+// with the same cipher as the real one. An existing file is only replaced with --force.
+// Example: spirit_gendb load.db --passwd 123 --days 90 --students 800 --classes 20
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include "../dbgen.h"
+
+int main(int argc, char** argv) {
+    using namespace Spirit;
+    std::string file, passwd;
+    bool force = false;
+    GenOptions opt;
+    try {
+        for (int i = 1; i < argc; i++) {
+            const std::string name = argv[i];
+            if (name == "--force") {
+                force = true;
+                continue;
+            }
+            if (name.rfind("--", 0) != 0) {
+                file = name;
+                continue;
+            }
+            if (i + 1 == argc)
+                throw std::invalid_argument("Missing value for " + name);
+            const std::string value = argv[++i];
+            if (name == "--passwd")
+                passwd = value;
+            else if (name == "--days")
+                opt.days = std::stoi(value);
+            else if (name == "--lessons")
+                opt.lessons = std::stoi(value);
+            else if (name == "--students")
+                opt.students = std::stoi(value);
+            else if (name == "--classes")
+                opt.classes = std::stoi(value);
+            else if (name == "--absent")
+                opt.absent = std::stod(value);
+            else if (name == "--excluded")
+                opt.excluded = std::stod(value);
+            else if (name == "--spacing")
+                opt.spacing = std::stoi(value);
+            else if (name == "--seed")
+                opt.seed = std::stoul(value);
+            else if (name == "--machine")
+                opt.machine = value;
+            else
+                throw std::invalid_argument("Unknown option " + name);
+        }
+        if (file.empty())
+            throw std::invalid_argument("No output file given");
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << '\n';
+        return 2;
+    }
+    if (std::ifstream(file)) {
+        if (!force) {
+            std::cerr << file << " exists, use --force to replace it\n";
+            return 1;
+        }
+        std::remove(file.c_str());
+    }
+    try {
+        // An empty key leaves the file unencrypted.
+        Connection conn(file, passwd);
+        const auto stats = generate_db(conn, opt);
+        std::cout << file << ": " << stats.lessons << " lessons, " << stats.records
+            << " records, " << stats.absent << " absent"
+            << (passwd.empty() ? ", plain\n" : ", encrypted\n");
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << '\n';
+        return 1;
+    }
+}
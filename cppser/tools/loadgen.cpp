@@ -0,0 +1,428 @@
+// Puts a running spiritd under controlled load over the singin protocol.
+// Usage: spirit_loadgen [--host ip] [--port n] [--qps n] [--duration sec] [--concurrency n]
+//     [--timeout ms] [--seed n] (--replay file [--loop] | [--mix spec] [--machine id]
+//     [--sessions n] [--roster n] [--names n])
+// --replay sends the requests found in a singer log (text or JSON lines, the "request"
+// records) in their order. Otherwise requests are drawn from --mix, which is a list of
+// command:weight, today_info:5,report_absent:4,write_record:1 by default.
+// write_record picks --names of the names 学生0 to 学生<roster - 1>, as spirit_gendb makes them.
+// quit_spirit is never sent. Requests go out at --qps whether or not the replies are back,
+// each of the --concurrency sockets has at most one in flight; when they are all busy,
+// the request is counted as backlogged instead.
+// The report is printed as JSON.
+// Example: spirit_loadgen --port 8303 --qps 500 --duration 30 --mix report_absent:1
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <nlohmann/json.hpp>
+
+namespace {
+    namespace asio = boost::asio;
+    using asio::ip::udp;
+    using nlohmann::json;
+    using LoadClock = std::chrono::steady_clock;
+
+    struct Options {
+        std::string host = "127.0.0.1";
+        int port = 8303;
+        double qps = 100;
+        double duration = 10;
+        int concurrency = 64;
+        int timeout = 1000;
+        unsigned seed = 42;
+        std::string replay;
+        bool loop = false;
+        std::string mix = "today_info:5,report_absent:4,write_record:1";
+        std::string machine = "SPIRIT-GEN";
+        int sessions = 10;
+        int roster = 60;
+        int names = 3;
+    };
+
+    Options parse_args(int argc, char** argv) {
+        Options opt;
+        for (int i = 1; i < argc; i++) {
+            const std::string name = argv[i];
+            if (name == "--loop") {
+                opt.loop = true;
+                continue;
+            }
+            if (i + 1 == argc)
+                throw std::invalid_argument("Missing value for " + name);
+            const std::string value = argv[++i];
+            if (name == "--host")
+                opt.host = value;
+            else if (name == "--port")
+                opt.port = std::stoi(value);
+            else if (name == "--qps")
+                opt.qps = std::stod(value);
+            else if (name == "--duration")
+                opt.duration = std::stod(value);
+            else if (name == "--concurrency")
+                opt.concurrency = std::stoi(value);
+            else if (name == "--timeout")
+                opt.timeout = std::stoi(value);
+            else if (name == "--seed")
+                opt.seed = std::stoul(value);
+            else if (name == "--replay")
+                opt.replay = value;
+            else if (name == "--mix")
+                opt.mix = value;
+            else if (name == "--machine")
+                opt.machine = value;
+            else if (name == "--sessions")
+                opt.sessions = std::stoi(value);
+            else if (name == "--roster")
+                opt.roster = std::stoi(value);
+            else if (name == "--names")
+                opt.names = std::stoi(value);
+            else
+                throw std::invalid_argument("Unknown option " + name);
+        }
+        if (opt.qps <= 0 || opt.duration <= 0 || opt.concurrency < 1 || opt.timeout < 1)
+            throw std::invalid_argument("qps, duration, concurrency and timeout should be positive");
+        if (opt.sessions < 1 || opt.roster < 1)
+            throw std::invalid_argument("sessions and roster should be positive");
+        if (opt.names < 0)
+            throw std::invalid_argument("names should not be negative");
+        return opt;
+    }
+
+    // A request ready to go.
+    struct Request {
+        std::string command, body;
+    };
+
+    // Pulls the requests out of a singer log. Both the text lines
+    //     <time> [info] request: 127.0.0.1:5000: {"command": ...}
+    // (or without the level and category, as older versions wrote them) and the JSON records
+    // with category "request" are understood. Anything else, responses included, is skipped.
+    std::vector<Request> load_replay(std::istream& in) {
+        std::vector<Request> requests;
+        std::string line;
+        while (std::getline(in, line)) {
+            std::string message = line;
+            if (!line.empty() && line.front() == '{') {
+                const auto record = json::parse(line, nullptr, false);
+                if (record.is_discarded() || record.value("category", "") != "request")
+                    continue;
+                message = record.value("message", "");
+            }
+            const auto pos = message.find(": {");
+            if (pos == std::string::npos)
+                continue;
+            const auto request = json::parse(message.substr(pos + 2), nullptr, false);
+            if (!request.is_object() || !request.contains("command") || !request["command"].is_string())
+                continue;
+            if (request["command"] == "quit_spirit")
+                continue;
+            requests.push_back({ request["command"], request.dump() });
+        }
+        return requests;
+    }
+
+    // Draws requests from the mix.
+    class Synthetic {
+    public:
+        explicit Synthetic(const Options& opt) : mOpt(opt), mRandom(opt.seed) {
+            std::vector<double> weights;
+            std::istringstream spec(opt.mix);
+            std::string item;
+            while (std::getline(spec, item, ',')) {
+                const auto colon = item.find(':');
+                const auto command = item.substr(0, colon);
+                if (command == "quit_spirit")
+                    throw std::invalid_argument("quit_spirit can't be in the mix");
+                const double weight = colon == std::string::npos ? 1 : std::stod(item.substr(colon + 1));
+                if (!std::isfinite(weight) || weight < 0)
+                    throw std::invalid_argument("The weight of " + command + " should be a non-negative number");
+                mCommands.push_back(command);
+                weights.push_back(weight);
+            }
+            if (mCommands.empty())
+                throw std::invalid_argument("The mix is empty");
+            if (std::accumulate(weights.begin(), weights.end(), 0.0) <= 0)
+                throw std::invalid_argument("The weights in the mix add up to zero");
+            mPick = std::discrete_distribution<std::size_t>(weights.begin(), weights.end());
+        }
+
+        Request operator() () {
+            const auto& command = mCommands[mPick(mRandom)];
+            json request = {{ "command", command }};
+            std::uniform_int_distribution<int> sessid(0, mOpt.sessions - 1), stu(0, mOpt.roster - 1);
+            if (command == "today_info")
+                request["machine"] = mOpt.machine;
+            else if (command == "report_absent")
+                request["sessid"] = sessid(mRandom);
+            else if (command == "write_record") {
+                request["sessid"] = sessid(mRandom);
+                request["name"] = json::array();
+                for (int i = 0; i < mOpt.names; i++)
+                    request["name"].push_back("学生" + std::to_string(stu(mRandom)));
+            } else if (command == "doggie_stick")
+                request["pause"] = false;
+            return { command, request.dump() };
+        }
+    private:
+        const Options& mOpt;
+        std::mt19937 mRandom;
+        std::vector<std::string> mCommands;
+        std::discrete_distribution<std::size_t> mPick;
+    };
+
+    // What happened to the requests of one command.
+    struct Tally {
+        long long sent = 0, ok = 0, failed = 0, lost = 0, errors = 0, backlogged = 0;
+        // Milliseconds, of the requests that got a reply.
+        std::vector<double> latency;
+
+        void merge(const Tally& rhs) {
+            sent += rhs.sent;
+            ok += rhs.ok;
+            failed += rhs.failed;
+            lost += rhs.lost;
+            errors += rhs.errors;
+            backlogged += rhs.backlogged;
+            latency.insert(latency.end(), rhs.latency.begin(), rhs.latency.end());
+        }
+
+        json to_json() {
+            std::sort(latency.begin(), latency.end());
+            auto quantile = [this](double q) {
+                if (latency.empty())
+                    return 0.0;
+                return latency[std::min(latency.size() - 1, static_cast<std::size_t>(q * latency.size()))];
+            };
+            double sum = 0;
+            for (auto t : latency)
+                sum += t;
+            return {
+                { "sent", sent }, { "ok", ok }, { "failed", failed }, { "lost", lost },
+                { "errors", errors }, { "backlogged", backlogged },
+                { "loss", sent ? static_cast<double>(lost + errors) / sent : 0.0 },
+                { "p50_ms", quantile(0.5) }, { "p99_ms", quantile(0.99) }, { "p999_ms", quantile(0.999) },
+                { "max_ms", latency.empty() ? 0.0 : latency.back() },
+                { "mean_ms", latency.empty() ? 0.0 : sum / latency.size() }
+            };
+        }
+    };
+
+    // Open loop load: requests are sent on schedule, each on an idle socket.
+    class LoadGen {
+    public:
+        LoadGen(const Options& opt, std::function<std::optional<Request>()> source) :
+            mOpt(opt), mSource(std::move(source)),
+            mServer(asio::ip::make_address(opt.host), opt.port)
+        {
+            for (int i = 0; i < opt.concurrency; i++)
+                mSlots.push_back(std::make_unique<Slot>(mIoc));
+            for (auto& slot : mSlots)
+                mIdle.push_back(slot.get());
+        }
+
+        json run() {
+            mStart = LoadClock::now();
+            mEnd = mStart + std::chrono::duration_cast<LoadClock::duration>(
+                std::chrono::duration<double>(mOpt.duration));
+            tick();
+            mIoc.run();
+            // Whatever is still out after the drain is lost.
+            for (auto& slot : mSlots)
+                if (slot->busy)
+                    ++mTally[slot->command].lost;
+            const double elapsed = std::chrono::duration<double>(mLast - mStart).count();
+            Tally total;
+            json commands = json::object();
+            for (auto& [command, tally] : mTally) {
+                total.merge(tally);
+                commands[command] = tally.to_json();
+            }
+            const auto received = total.ok + total.failed;
+            return {
+                { "target_qps", mOpt.qps },
+                { "elapsed_s", elapsed },
+                { "throughput_rps", elapsed > 0 ? received / elapsed : 0.0 },
+                { "total", total.to_json() },
+                { "commands", commands }
+            };
+        }
+    private:
+        struct Slot {
+            udp::socket socket;
+            asio::steady_timer timer;
+            std::array<char, 65536> buff;
+            LoadClock::time_point sent;
+            std::string command;
+            bool busy = false;
+            // Datagrams of a split response received so far
+            std::size_t parts = 0;
+            // Counts the requests, so that a completion for an older one is ignored.
+            unsigned epoch = 0;
+
+            explicit Slot(asio::io_context& ioc) : socket(ioc), timer(ioc) {}
+        };
+
+        const Options& mOpt;
+        std::function<std::optional<Request>()> mSource;
+        asio::io_context mIoc;
+        const udp::endpoint mServer;
+        std::vector<std::unique_ptr<Slot>> mSlots;
+        std::vector<Slot*> mIdle;
+        asio::steady_timer mTicker{ mIoc };
+        LoadClock::time_point mStart, mEnd, mLast;
+        long long mIssued = 0;
+        std::map<std::string, Tally> mTally;
+
+        // Sends the requests that are due and sleeps until the next one.
+        void tick() {
+            const auto now = LoadClock::now();
+            mLast = now;
+            if (now < mEnd) {
+                const auto due = static_cast<long long>(
+                    std::chrono::duration<double>(now - mStart).count() * mOpt.qps) + 1;
+                for (; mIssued < due; mIssued++) {
+                    auto request = mSource();
+                    if (!request)
+                        return drain();
+                    issue(std::move(*request));
+                }
+                mTicker.expires_at(mStart + std::chrono::duration_cast<LoadClock::duration>(
+                    std::chrono::duration<double>(mIssued / mOpt.qps)));
+                mTicker.async_wait([this](const boost::system::error_code& ec) {
+                    if (!ec)
+                        tick();
+                });
+            } else
+                drain();
+        }
+
+        // Gives the requests in flight their time, then stops.
+        void drain() {
+            mTicker.expires_after(std::chrono::milliseconds(mOpt.timeout + 100));
+            mTicker.async_wait([this](const boost::system::error_code&) { mIoc.stop(); });
+        }
+
+        void issue(Request request) {
+            auto& tally = mTally[request.command];
+            if (mIdle.empty()) {
+                ++tally.backlogged;
+                return;
+            }
+            Slot& slot = *mIdle.back();
+            mIdle.pop_back();
+            if (!slot.socket.is_open()) {
+                boost::system::error_code ec;
+                slot.socket.open(udp::v4(), ec);
+                // Connecting filters out datagrams from others, and gets us
+                // an error if nobody is listening on the port.
+                if (!ec)
+                    slot.socket.connect(mServer, ec);
+                if (ec) {
+                    ++tally.errors;
+                    slot.socket.close(ec);
+                    mIdle.push_back(&slot);
+                    return;
+                }
+            }
+            ++tally.sent;
+            slot.busy = true;
+            slot.parts = 0;
+            slot.command = request.command;
+            const auto epoch = ++slot.epoch;
+            auto body = std::make_shared<std::string>(std::move(request.body));
+            slot.sent = LoadClock::now();
+            slot.socket.async_send(asio::buffer(*body), [body](const boost::system::error_code&, std::size_t) {
+                // Failures show up on the receive.
+            });
+            receive(slot, epoch);
+            slot.timer.expires_after(std::chrono::milliseconds(mOpt.timeout));
+            slot.timer.async_wait([this, &slot, epoch](const boost::system::error_code& ec) {
+                if (ec || epoch != slot.epoch || !slot.busy)
+                    return;
+                ++mTally[slot.command].lost;
+                // A late reply must not be taken for the next request's.
+                release(slot, true);
+            });
+        }
+
+        // Waits for the reply, all of its datagrams if the server split it.
+        void receive(Slot& slot, unsigned epoch) {
+            slot.socket.async_receive(asio::buffer(slot.buff),
+                [this, &slot, epoch](const boost::system::error_code& ec, std::size_t n) {
+                    if (epoch != slot.epoch || !slot.busy)
+                        return;
+                    auto& tally = mTally[slot.command];
+                    if (ec) {
+                        slot.timer.cancel();
+                        ++tally.errors;
+                        return release(slot, true);
+                    }
+                    const auto reply = json::parse(slot.buff.data(), slot.buff.data() + n, nullptr, false);
+                    if (reply.is_object() && ++slot.parts < reply.value("count", std::size_t(1)))
+                        return receive(slot, epoch);
+                    slot.timer.cancel();
+                    const auto now = LoadClock::now();
+                    mLast = std::max(mLast, now);
+                    tally.latency.push_back(std::chrono::duration<double, std::milli>(now - slot.sent).count());
+                    if (reply.is_object() && reply.value("success", false))
+                        ++tally.ok;
+                    else
+                        ++tally.failed;
+                    release(slot, false);
+                }
+            );
+        }
+
+        void release(Slot& slot, bool reopen) {
+            slot.busy = false;
+            if (reopen) {
+                boost::system::error_code ec;
+                slot.socket.close(ec);
+            }
+            mIdle.push_back(&slot);
+        }
+    };
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    std::function<std::optional<Request>()> source;
+    try {
+        opt = parse_args(argc, argv);
+        if (!opt.replay.empty()) {
+            std::ifstream in(opt.replay);
+            if (!in)
+                throw std::runtime_error("Cannot open " + opt.replay);
+            auto requests = std::make_shared<std::vector<Request>>(load_replay(in));
+            if (requests->empty())
+                throw std::runtime_error("No requests found in " + opt.replay);
+            source = [requests, next = std::size_t(0), loop = opt.loop]() mutable -> std::optional<Request> {
+                if (next == requests->size()) {
+                    if (!loop)
+                        return std::nullopt;
+                    next = 0;
+                }
+                return (*requests)[next++];
+            };
+        } else {
+            auto synthetic = std::make_shared<Synthetic>(opt);
+            source = [synthetic]() -> std::optional<Request> { return (*synthetic)(); };
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << '\n';
+        return 2;
+    }
+    LoadGen gen(opt, std::move(source));
+    std::cout << gen.run().dump(2) << '\n';
+}
@@ -1,13 +1,23 @@
 #include "singd.h"
+#include <algorithm>
+#include <ctime>
 
 namespace Spirit {
+    // Changes when the local date does.
+    static int current_day() {
+        const auto t = std::time(nullptr);
+        const auto ct = std::localtime(&t);
+        return ct->tm_year * 1000 + ct->tm_yday;
+    }
+
     // Chores come first.
-    Watchdog::Watchdog(const Spirit::Configuration& config) :
-        mConfig(config)
+    Watchdog::Watchdog(const Spirit::Configuration& config, DBService& db, GSClient& gs) :
+        mConfig(config), mDB(db), mGS(gs)
     {}
 
     Watchdog::~Watchdog() noexcept {
         mStopToken = true;
+        wake();
         if (mThread && mThread->joinable()) {
             mThread->join();
         }
@@ -19,164 +29,185 @@ namespace Spirit {
 
     void Watchdog::pause() noexcept {
         mPauseToken = true;
+        wake();
     }
 
     void Watchdog::resume() noexcept {
         mPauseToken = false;
+        wake();
     }
 
-    void Watchdog::simul_sign(Connection& conn, const LessonInfo& lesson, Logfile& logfile) {
-        auto absent = report_absent(conn, lesson.id);
-        // The JSON result from server
-        auto stu_new = get_stu_new(mConfig, absent, lesson, logfile);
-        // People who need DK
-        std::vector<Student> need_card;
-        need_card.reserve(absent.size());
-        // People who are invalid, represented as names
-        std::vector<std::string> invalid;
-        invalid.reserve(60);
-        // First calculate the invalids
-        for (auto&& stu : stu_new["result"]["students"]) {
-            if (stu["Invalid"])
-                invalid.push_back(stu["StudentName"]);
+    void Watchdog::wake() noexcept {
+        {
+            // The sleeper checks the tokens with the lock held, so this can't slip in between.
+            std::lock_guard lock(mMutex);
         }
-        // Then O(n2) calculate the difference.
-        for (auto&& i : absent) {
-            bool flag = true;
-            for (auto&& j : invalid)
-                if (i.name == j) {
-                    flag = false;
-                    break;
-                }
-            if (flag)
-                need_card.push_back(std::move(i));
+        mCond.notify_all();
+    }
+
+    void Watchdog::sleep(std::chrono::seconds duration, bool paused) {
+        std::unique_lock lock(mMutex);
+        mCond.wait_for(lock, duration, [this, paused]{ return mStopToken || mPauseToken != paused; });
+    }
+
+    void Watchdog::simul_sign(const LessonInfo& lesson, Logfile& logfile) {
+        Stopwatch watch(metrics().phase("simul_sign"));
+        auto absent = mDB.submit([&lesson](Connection& conn) {
+            return report_absent(conn, lesson.id);
+        }).get();
+        // The students' status from the server
+        std::vector<StudentStatus> stu_new;
+        {
+            Stopwatch fetch(metrics().phase("stu_new"));
+            stu_new = get_stu_new(mHttp, mConfig, absent, lesson, logfile);
+            fetch.success();
         }
-        logfile << "Invalid: " << invalid.size() << "   Need card: " << need_card.size() << '\n';
-        if (need_card.empty())
+        const auto invalid = std::count_if(stu_new.begin(), stu_new.end(),
+            [](const StudentStatus& stu) { return stu.invalid; });
+        // People who need DK
+        const auto need_card = exclude_invalid(std::move(absent), stu_new);
+        SPIRIT_LOG(logfile, info, "watchdog") << "Invalid: " << invalid << "   Need card: " << need_card.size() << '\n';
+        if (need_card.empty()) {
+            watch.success();
             return;
+        }
         // If we restart here, we can take advantage of the restarting time,
         // to avoid collision.
         // Because both exceptions can be fallen through without affecting the other code,
         // so we handle them in this function instead of propagating them upward.
         try {
-            send_to_gs(mConfig, logfile, "$DoRestart");
+            mGS.send("$DoRestart", logfile);
         } catch (const NetworkError& ex) {
-            logfile << "Networking error when restarting GS: " << ex.what() << '\n';
+            SPIRIT_LOG(logfile, warn, "watchdog") << "Networking error when restarting GS: " << ex.what() << '\n';
         } catch (const GSError& ex) {
-            logfile << "GS internal error when we asked it to restart, quite strange! Output:\n"
+            SPIRIT_LOG(logfile, error, "watchdog") << "GS internal error when we asked it to restart, quite strange! Output:\n"
                 << ex.what() << '\n';
         }
         RandomClock clock(lesson.endtime - 300, lesson.endtime - 120);
-        write_record(conn, lesson.id, need_card, clock);
+        mDB.submit([&](Connection& conn) {
+            write_record(conn, lesson.id, need_card, clock);
+        }, DBService::Priority::high).get();
+        watch.success();
     }
 
-    void Watchdog::local_sign(Connection& localdata, const LessonInfo& lesson, Logfile& logfile) {
-        auto need_card = report_absent(localdata, lesson.id, true);
-        logfile << "Need card: " << need_card.size() << '\n';
+    void Watchdog::local_sign(const LessonInfo& lesson, Logfile& logfile) {
+        Stopwatch watch(metrics().phase("local_sign"));
+        auto need_card = mDB.submit([&lesson](Connection& conn) {
+            return report_absent(conn, lesson.id, true);
+        }).get();
+        SPIRIT_LOG(logfile, info, "watchdog") << "Need card: " << need_card.size() << '\n';
         // See the comment above
         try {
-            send_to_gs(mConfig, logfile, "$DoRestart");
+            mGS.send("$DoRestart", logfile);
         } catch (const NetworkError& ex) {
-            logfile << "Networking error when restarting GS: " << ex.what() << '\n';
+            SPIRIT_LOG(logfile, warn, "watchdog") << "Networking error when restarting GS: " << ex.what() << '\n';
         } catch (const GSError& ex) {
-            logfile << "GS internal error when we asked it to restart, quite strange! Output:\n"
+            SPIRIT_LOG(logfile, error, "watchdog") << "GS internal error when we asked it to restart, quite strange! Output:\n"
                 << ex.what() << '\n';
         }
         RandomClock clock(lesson.endtime - 300, lesson.endtime - 120);
-        write_record(localdata, lesson.id, need_card, clock);
+        mDB.submit([&](Connection& conn) {
+            write_record(conn, lesson.id, need_card, clock);
+        }, DBService::Priority::high).get();
+        watch.success();
     }
 
     void Watchdog::worker() {
         // First, create a log file and report our existence.
         // Maybe std::endl will force the streams to flush, making the log up to date.
-        // The performance overhead is negligible compared to 15 second polls.
-        Logfile log(select_logfile("watchdog", mConfig["keep_logs"]));
-        log << "Watchdog launched." << std::endl;
-        // Then read the config db for localdata's name and password
-        std::string dbname, passwd;
-        try {
-            dbname = mConfig["dbname"];
-            passwd = mConfig["passwd"];
-            if (dbname.empty())
-                throw std::runtime_error("No dbname specified!");
-            if (passwd.empty())
-                throw std::runtime_error("No passwd specified!");
-        } catch (const std::runtime_error& ex) {
-            log << "Error when reading configuration for dbname or passwd!\n"
-                << "ex.what(): " << ex.what() << '\n';
-            return;
-        }
+        // The performance overhead is negligible, we only wake up for lessons.
+        Logfile log(select_logfile("watchdog", mConfig["keep_logs"]), std::ios::out,
+            log_options(mConfig, "watchdog"));
+        SPIRIT_LOG(log, info, "watchdog") << "Watchdog launched." << std::endl;
+        const std::chrono::seconds poll(mConfig["watchdog_poll"]), retry(mConfig["retry_wait"]);
+        const int simul_limit = mConfig["simul_limit"], local_limit = mConfig["local_limit"];
         loop_start:
         try {
-            Connection local_data(dbname, passwd);
-            // The last lesson processed, expressed as endtime.
-            int last_proc = -1;
+            // The last lesson processed, expressed as endtime, and the day it was on.
+            // Lessons are processed in the order of their endtimes.
+            int last_proc = -1, last_day = current_day();
             // Mainloop here
             while (true) {
                 // First check for stop requests
                 if (mStopToken) {
-                    log << "Requested stop.\n";
+                    SPIRIT_LOG(log, info, "watchdog") << "Requested stop.\n";
                     return;
                 }
-                // Then check if paused
+                // Then check if paused, resume() will wake us up.
                 if (mPauseToken) {
-                    std::this_thread::sleep_for(std::chrono::seconds(mConfig["watchdog_poll"]));
+                    sleep(std::chrono::hours(24), true);
                     continue;
                 }
                 // Flush every loop.
                 LogSection log_section(log);
-                // Lessons that are nearing an end.
-                std::vector<LessonInfo> near_ending;
+                // Today's lessons sorted by endtime. This only queries 课程信息 again
+                // if the database has been changed.
+                std::vector<LessonInfo> timeline;
                 try {
-                    near_ending = near_exits(local_data, mConfig["simul_limit"]);
+                    Stopwatch watch(metrics().phase("schedule"));
+                    timeline = mDB.submit([this](Connection& conn) {
+                        auto lessons = mSchedule.lessons(conn);
+                        std::sort(lessons.begin(), lessons.end(),
+                            [](const LessonInfo& a, const LessonInfo& b) { return a.endtime < b.endtime; });
+                        return lessons;
+                    }).get();
+                    watch.success();
                 } catch (const SQLError& ex) {
-                    log << "Encountering SQL error when calling near_exits()\n"
+                    SPIRIT_LOG(log, error, "watchdog") << "Encountering SQL error when loading the schedule\n"
                         << "SQLError: " << ex.what() << '\n';
-                    std::this_thread::sleep_for(std::chrono::seconds(mConfig["retry_wait"]));
+                    sleep(retry);
+                    continue;
+                }
+                const int now = CurrentClock().get_ticks();
+                if (const int today = current_day(); today != last_day) {
+                    last_proc = -1;
+                    last_day = today;
+                }
+                const auto next = next_lesson(timeline, now, last_proc);
+                if (!next) {
+                    // Nothing left for today. GS might still download new lessons.
+                    sleep(poll);
                     continue;
                 }
-                if (near_ending.empty() || near_ending.front().endtime == last_proc) {
-                    // Nothing to do, or already processed.
-                    std::this_thread::sleep_for(std::chrono::seconds(mConfig["watchdog_poll"]));
+                if (next->endtime - now > simul_limit) {
+                    // Sleep until the lesson is due, but look at the schedule again
+                    // after poll in case it has changed.
+                    sleep(std::min(std::chrono::seconds(next->endtime - now - simul_limit), poll));
                     continue;
                 }
-                auto& lesson = near_ending.front();
+                const auto lesson = *next;
                 try {
-                    if (lesson.endtime - CurrentClock().get_ticks() >= mConfig["local_limit"]) {
-                        log << "Start web-based processing lesson " << lesson.anpai << '\n';
-                        simul_sign(local_data, lesson, log);
+                    if (lesson.endtime - now >= local_limit) {
+                        SPIRIT_LOG(log, info, "watchdog") << "Start web-based processing lesson " << lesson.anpai << '\n';
+                        simul_sign(lesson, log);
                     } else {
-                        log << "Too impatient, resort to local sign in!\n";
-                        local_sign(local_data, lesson, log);
+                        SPIRIT_LOG(log, warn, "watchdog") << "Too impatient, resort to local sign in!\n";
+                        local_sign(lesson, log);
                     }
                     // Now we have a good session
-                    log << "process_lesson returned successfully.\n";
+                    SPIRIT_LOG(log, info, "watchdog") << "process_lesson returned successfully.\n";
                     last_proc = lesson.endtime;
-                    std::this_thread::sleep_for(std::chrono::seconds(mConfig["watchdog_poll"]));
                 } catch (const NetworkError& ex) {
                     // Network error means that we can try again.
-                    log << "NetworkError: " << ex.what() << '\n';
-                    std::this_thread::sleep_for(std::chrono::seconds(mConfig["retry_wait"]));
+                    SPIRIT_LOG(log, warn, "watchdog") << "NetworkError: " << ex.what() << '\n';
+                    sleep(retry);
                 } catch (const std::logic_error& ex) {
-                    log << "logic_error: " << ex.what() << '\n';
+                    SPIRIT_LOG(log, error, "watchdog") << "logic_error: " << ex.what() << '\n';
                     // Very bad config file, just skip it
                     last_proc = lesson.endtime;
-                    std::this_thread::sleep_for(std::chrono::seconds(mConfig["retry_wait"]));
+                    sleep(retry);
                 } catch (const nlohmann::json::parse_error& ex) {
-                    log << "Wrong format from server: " << ex.what() << '\n';
-                    std::this_thread::sleep_for(std::chrono::seconds(mConfig["retry_wait"]));
+                    SPIRIT_LOG(log, warn, "watchdog") << "Wrong format from server: " << ex.what() << '\n';
+                    sleep(retry);
                 } catch (const SQLError& ex) {
-                    log << "SQL Error: " << ex.what() << '\n';
-                    std::this_thread::sleep_for(std::chrono::seconds(mConfig["retry_wait"]));
+                    SPIRIT_LOG(log, error, "watchdog") << "SQL Error: " << ex.what() << '\n';
+                    sleep(retry);
                 }
             }
-        } catch (const ErrorOpeningDatabase& ex) {
-            log << "ErrorOpeningDatabase: " << ex.what() << '\n'
-                << "Exiting because of failure.\n";
         } catch (const std::exception& ex) {
-            log << "Unexpected std::exception: " << ex.what() << '\n';
-            log << "Restarting watchdog!\n";
+            SPIRIT_LOG(log, error, "watchdog") << "Unexpected std::exception: " << ex.what() << '\n'
+                << "Restarting watchdog!\n";
             goto loop_start;
         }
     }
-}
\ No newline at end of file
+}